@@ -1,7 +1,66 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <assert.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <strings.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+// the MSVC CRT functions used below, for other compilers. strings are truncated to fit
+inline int fopen_s(FILE **f, const char *name, const char *mode)
+{
+    *f = fopen(name, mode);
+    return *f ? 0 : -1;
+}
+
+inline int strcpy_s(char *dest, size_t size, const char *src)
+{
+    size_t length = strlen(src);
+    if (length >= size)
+    {
+        length = size - 1;
+    }
+    memcpy(dest, src, length);
+    dest[length] = 0;
+    return 0;
+}
+
+template <size_t N>
+inline int strcat_s(char (&dest)[N], const char *src)
+{
+    size_t used = strnlen(dest, N);
+    return (used < N) ? strcpy_s(dest + used, N - used, src) : -1;
+}
+
+inline size_t strnlen_s(const char *text, size_t size)
+{
+    return text ? strnlen(text, size) : 0;
+}
+
+#define _strnicmp strncasecmp
+#endif
 
 enum address_mode
 {
@@ -19,6 +78,14 @@ enum address_mode
     address_mode_ind,
     address_mode_ind_x,
     address_mode_ind_y,
+    address_mode_count,
+};
+
+enum cycle_penalty
+{
+    penalty_none,
+    penalty_page,   // +1 when the indexed address crosses a page
+    penalty_branch, // +1 when taken, +1 more when the target is on another page
 };
 
 struct opcode
@@ -26,952 +93,7581 @@ struct opcode
     const char *mnemonic;
     int length;
     address_mode mode;
+    int cycles; // base cycle count, without page crossing or taken branch penalties
+    cycle_penalty penalty;
 };
 
-opcode opcodes[256];
+// every documented opcode, written once; the decode table, the encoder index and the
+// listing templates are all derived from this list at compile time
 
-inline void init_opcode(int id, const char *mnemonic, int length, address_mode mode)
+struct opcode_def
 {
-    opcodes[id].mnemonic = mnemonic;
-    opcodes[id].length = length;
-    opcodes[id].mode = mode;
-}
+    int id;
+    const char *mnemonic;
+    int length;
+    address_mode mode;
+    int cycles;
+    cycle_penalty penalty;
+};
 
-int disasm_single(unsigned char *bytes, int offset, int base_address, FILE *file)
+constexpr opcode_def opcode_defs[] =
 {
-    int id = bytes[offset];
-    const char *mnemonic = opcodes[id].mnemonic;
-    address_mode mode = opcodes[id].mode;
-
-    unsigned int address = offset + base_address;
-    unsigned int byte = bytes[offset + 1];
-    unsigned int word = (bytes[offset + 2] << 8) | (bytes[offset + 1] & 0xff);
-    unsigned int rel = offset + base_address + 2 + (signed char)byte;
-
-    fprintf(file, "$%04x    ", address);
+    { 0x69, "ADC", 2, address_mode_imm, 2, penalty_none },
+    { 0x65, "ADC", 2, address_mode_zp, 3, penalty_none },
+    { 0x75, "ADC", 2, address_mode_zp_x, 4, penalty_none },
+    { 0x6D, "ADC", 3, address_mode_abs, 4, penalty_none },
+    { 0x7D, "ADC", 3, address_mode_abs_x, 4, penalty_page },
+    { 0x79, "ADC", 3, address_mode_abs_y, 4, penalty_page },
+    { 0x61, "ADC", 2, address_mode_ind_x, 6, penalty_none },
+    { 0x71, "ADC", 2, address_mode_ind_y, 5, penalty_page },
+    { 0x29, "AND", 2, address_mode_imm, 2, penalty_none },
+    { 0x25, "AND", 2, address_mode_zp, 3, penalty_none },
+    { 0x35, "AND", 2, address_mode_zp_x, 4, penalty_none },
+    { 0x2D, "AND", 3, address_mode_abs, 4, penalty_none },
+    { 0x3D, "AND", 3, address_mode_abs_x, 4, penalty_page },
+    { 0x39, "AND", 3, address_mode_abs_y, 4, penalty_page },
+    { 0x21, "AND", 2, address_mode_ind_x, 6, penalty_none },
+    { 0x31, "AND", 2, address_mode_ind_y, 5, penalty_page },
+    { 0x0A, "ASL", 1, address_mode_acc, 2, penalty_none },
+    { 0x06, "ASL", 2, address_mode_zp, 5, penalty_none },
+    { 0x16, "ASL", 2, address_mode_zp_x, 6, penalty_none },
+    { 0x0E, "ASL", 3, address_mode_abs, 6, penalty_none },
+    { 0x1E, "ASL", 3, address_mode_abs_x, 7, penalty_none },
+    { 0x24, "BIT", 2, address_mode_zp, 3, penalty_none },
+    { 0x2C, "BIT", 3, address_mode_abs, 4, penalty_none },
+    { 0x00, "BRK", 1, address_mode_imp, 7, penalty_none },
+    { 0xC9, "CMP", 2, address_mode_imm, 2, penalty_none },
+    { 0xC5, "CMP", 2, address_mode_zp, 3, penalty_none },
+    { 0xD5, "CMP", 2, address_mode_zp_x, 4, penalty_none },
+    { 0xCD, "CMP", 3, address_mode_abs, 4, penalty_none },
+    { 0xDD, "CMP", 3, address_mode_abs_x, 4, penalty_page },
+    { 0xD9, "CMP", 3, address_mode_abs_y, 4, penalty_page },
+    { 0xC1, "CMP", 2, address_mode_ind_x, 6, penalty_none },
+    { 0xD1, "CMP", 2, address_mode_ind_y, 5, penalty_page },
+    { 0xE0, "CPX", 2, address_mode_imm, 2, penalty_none },
+    { 0xE4, "CPX", 2, address_mode_zp, 3, penalty_none },
+    { 0xEC, "CPX", 3, address_mode_abs, 4, penalty_none },
+    { 0xC0, "CPY", 2, address_mode_imm, 2, penalty_none },
+    { 0xC4, "CPY", 2, address_mode_zp, 3, penalty_none },
+    { 0xCC, "CPY", 3, address_mode_abs, 4, penalty_none },
+    { 0xC6, "DEC", 2, address_mode_zp, 5, penalty_none },
+    { 0xD6, "DEC", 2, address_mode_zp_x, 6, penalty_none },
+    { 0xCE, "DEC", 3, address_mode_abs, 6, penalty_none },
+    { 0xDE, "DEC", 3, address_mode_abs_x, 7, penalty_none },
+    { 0x42, "WDM", 2, address_mode_imm, 2, penalty_none }, // 65C816
+    { 0x49, "EOR", 2, address_mode_imm, 2, penalty_none },
+    { 0x45, "EOR", 2, address_mode_zp, 3, penalty_none },
+    { 0x55, "EOR", 2, address_mode_zp_x, 4, penalty_none },
+    { 0x4D, "EOR", 3, address_mode_abs, 4, penalty_none },
+    { 0x5D, "EOR", 3, address_mode_abs_x, 4, penalty_page },
+    { 0x59, "EOR", 3, address_mode_abs_y, 4, penalty_page },
+    { 0x41, "EOR", 2, address_mode_ind_x, 6, penalty_none },
+    { 0x51, "EOR", 2, address_mode_ind_y, 5, penalty_page },
+    { 0xE6, "INC", 2, address_mode_zp, 5, penalty_none },
+    { 0xF6, "INC", 2, address_mode_zp_x, 6, penalty_none },
+    { 0xEE, "INC", 3, address_mode_abs, 6, penalty_none },
+    { 0xFE, "INC", 3, address_mode_abs_x, 7, penalty_none },
+    { 0x4C, "JMP", 3, address_mode_abs, 3, penalty_none },
+    { 0x6C, "JMP", 3, address_mode_ind, 5, penalty_none },
+    { 0x20, "JSR", 3, address_mode_abs, 6, penalty_none },
+    { 0xA9, "LDA", 2, address_mode_imm, 2, penalty_none },
+    { 0xA5, "LDA", 2, address_mode_zp, 3, penalty_none },
+    { 0xB5, "LDA", 2, address_mode_zp_x, 4, penalty_none },
+    { 0xAD, "LDA", 3, address_mode_abs, 4, penalty_none },
+    { 0xBD, "LDA", 3, address_mode_abs_x, 4, penalty_page },
+    { 0xB9, "LDA", 3, address_mode_abs_y, 4, penalty_page },
+    { 0xA1, "LDA", 2, address_mode_ind_x, 6, penalty_none },
+    { 0xB1, "LDA", 2, address_mode_ind_y, 5, penalty_page },
+    { 0xA2, "LDX", 2, address_mode_imm, 2, penalty_none },
+    { 0xA6, "LDX", 2, address_mode_zp, 3, penalty_none },
+    { 0xB6, "LDX", 2, address_mode_zp_y, 4, penalty_none },
+    { 0xAE, "LDX", 3, address_mode_abs, 4, penalty_none },
+    { 0xBE, "LDX", 3, address_mode_abs_y, 4, penalty_page },
+    { 0xA0, "LDY", 2, address_mode_imm, 2, penalty_none },
+    { 0xA4, "LDY", 2, address_mode_zp, 3, penalty_none },
+    { 0xB4, "LDY", 2, address_mode_zp_x, 4, penalty_none },
+    { 0xAC, "LDY", 3, address_mode_abs, 4, penalty_none },
+    { 0xBC, "LDY", 3, address_mode_abs_x, 4, penalty_page },
+    { 0x4A, "LSR", 1, address_mode_acc, 2, penalty_none },
+    { 0x46, "LSR", 2, address_mode_zp, 5, penalty_none },
+    { 0x56, "LSR", 2, address_mode_zp_x, 6, penalty_none },
+    { 0x4E, "LSR", 3, address_mode_abs, 6, penalty_none },
+    { 0x5E, "LSR", 3, address_mode_abs_x, 7, penalty_none },
+    { 0xEA, "NOP", 1, address_mode_imp, 2, penalty_none },
+    { 0x09, "ORA", 2, address_mode_imm, 2, penalty_none },
+    { 0x05, "ORA", 2, address_mode_zp, 3, penalty_none },
+    { 0x15, "ORA", 2, address_mode_zp_x, 4, penalty_none },
+    { 0x0D, "ORA", 3, address_mode_abs, 4, penalty_none },
+    { 0x1D, "ORA", 3, address_mode_abs_x, 4, penalty_page },
+    { 0x19, "ORA", 3, address_mode_abs_y, 4, penalty_page },
+    { 0x01, "ORA", 2, address_mode_ind_x, 6, penalty_none },
+    { 0x11, "ORA", 2, address_mode_ind_y, 5, penalty_page },
+    { 0x2A, "ROL", 1, address_mode_acc, 2, penalty_none },
+    { 0x26, "ROL", 2, address_mode_zp, 5, penalty_none },
+    { 0x36, "ROL", 2, address_mode_zp_x, 6, penalty_none },
+    { 0x2E, "ROL", 3, address_mode_abs, 6, penalty_none },
+    { 0x3E, "ROL", 3, address_mode_abs_x, 7, penalty_none },
+    { 0x6A, "ROR", 1, address_mode_acc, 2, penalty_none },
+    { 0x66, "ROR", 2, address_mode_zp, 5, penalty_none },
+    { 0x76, "ROR", 2, address_mode_zp_x, 6, penalty_none },
+    { 0x6E, "ROR", 3, address_mode_abs, 6, penalty_none },
+    { 0x7E, "ROR", 3, address_mode_abs_x, 7, penalty_none },
+    { 0x40, "RTI", 1, address_mode_imp, 6, penalty_none },
+    { 0x60, "RTS", 1, address_mode_imp, 6, penalty_none },
+    { 0xE9, "SBC", 2, address_mode_imm, 2, penalty_none },
+    { 0xE5, "SBC", 2, address_mode_zp, 3, penalty_none },
+    { 0xF5, "SBC", 2, address_mode_zp_x, 4, penalty_none },
+    { 0xED, "SBC", 3, address_mode_abs, 4, penalty_none },
+    { 0xFD, "SBC", 3, address_mode_abs_x, 4, penalty_page },
+    { 0xF9, "SBC", 3, address_mode_abs_y, 4, penalty_page },
+    { 0xE1, "SBC", 2, address_mode_ind_x, 6, penalty_none },
+    { 0xF1, "SBC", 2, address_mode_ind_y, 5, penalty_page },
+    { 0x85, "STA", 2, address_mode_zp, 3, penalty_none },
+    { 0x95, "STA", 2, address_mode_zp_x, 4, penalty_none },
+    { 0x8D, "STA", 3, address_mode_abs, 4, penalty_none },
+    { 0x9D, "STA", 3, address_mode_abs_x, 5, penalty_none },
+    { 0x99, "STA", 3, address_mode_abs_y, 5, penalty_none },
+    { 0x81, "STA", 2, address_mode_ind_x, 6, penalty_none },
+    { 0x91, "STA", 2, address_mode_ind_y, 6, penalty_none },
+    { 0x86, "STX", 2, address_mode_zp, 3, penalty_none },
+    { 0x96, "STX", 2, address_mode_zp_y, 4, penalty_none },
+    { 0x8E, "STX", 3, address_mode_abs, 4, penalty_none },
+    { 0x84, "STY", 2, address_mode_zp, 3, penalty_none },
+    { 0x94, "STY", 2, address_mode_zp_x, 4, penalty_none },
+    { 0x8C, "STY", 3, address_mode_abs, 4, penalty_none },
+    { 0x10, "BPL", 2, address_mode_rel, 2, penalty_branch },
+    { 0x30, "BMI", 2, address_mode_rel, 2, penalty_branch },
+    { 0x50, "BVC", 2, address_mode_rel, 2, penalty_branch },
+    { 0x70, "BVS", 2, address_mode_rel, 2, penalty_branch },
+    { 0x90, "BCC", 2, address_mode_rel, 2, penalty_branch },
+    { 0xB0, "BCS", 2, address_mode_rel, 2, penalty_branch },
+    { 0xD0, "BNE", 2, address_mode_rel, 2, penalty_branch },
+    { 0xF0, "BEQ", 2, address_mode_rel, 2, penalty_branch },
+    { 0xAA, "TAX", 1, address_mode_imp, 2, penalty_none },
+    { 0x8A, "TXA", 1, address_mode_imp, 2, penalty_none },
+    { 0xCA, "DEX", 1, address_mode_imp, 2, penalty_none },
+    { 0xE8, "INX", 1, address_mode_imp, 2, penalty_none },
+    { 0xA8, "TAY", 1, address_mode_imp, 2, penalty_none },
+    { 0x98, "TYA", 1, address_mode_imp, 2, penalty_none },
+    { 0x88, "DEY", 1, address_mode_imp, 2, penalty_none },
+    { 0xC8, "INY", 1, address_mode_imp, 2, penalty_none },
+    { 0x18, "CLC", 1, address_mode_imp, 2, penalty_none },
+    { 0x38, "SEC", 1, address_mode_imp, 2, penalty_none },
+    { 0x58, "CLI", 1, address_mode_imp, 2, penalty_none },
+    { 0x78, "SEI", 1, address_mode_imp, 2, penalty_none },
+    { 0xB8, "CLV", 1, address_mode_imp, 2, penalty_none },
+    { 0xD8, "CLD", 1, address_mode_imp, 2, penalty_none },
+    { 0xF8, "SED", 1, address_mode_imp, 2, penalty_none },
+    { 0x9A, "TXS", 1, address_mode_imp, 2, penalty_none },
+    { 0xBA, "TSX", 1, address_mode_imp, 2, penalty_none },
+    { 0x48, "PHA", 1, address_mode_imp, 3, penalty_none },
+    { 0x68, "PLA", 1, address_mode_imp, 4, penalty_none },
+    { 0x08, "PHP", 1, address_mode_imp, 3, penalty_none },
+    { 0x28, "PLP", 1, address_mode_imp, 4, penalty_none },
+};
 
-    if (opcodes[id].length == 3)
-    {
-        fprintf(file, "%02x %02x %02x  ", bytes[offset], bytes[offset + 1], bytes[offset + 2]);
-    }
-    else if (opcodes[id].length == 2)
-    {
-        fprintf(file, "%02x %02x     ", bytes[offset], bytes[offset + 1]);
-    }
-    else
-    {
-        fprintf(file, "%02x        ", bytes[offset]);
-    }
+#define OPCODE_DEF_COUNT (int)(sizeof(opcode_defs) / sizeof(opcode_defs[0]))
 
+constexpr int mode_length(address_mode mode)
+{
     switch (mode)
     {
+        case address_mode_imp:
+        case address_mode_acc:
+            return 1;
         case address_mode_abs:
-            fprintf(file, "%s $%04x\n", mnemonic, word);
-            break;
         case address_mode_abs_x:
-            fprintf(file, "%s $%04x,X\n", mnemonic, word);
-            break;
         case address_mode_abs_y:
-            fprintf(file, "%s $%04x,Y\n", mnemonic, word);
-            break;
-        case address_mode_imp:
-            fprintf(file, "%s\n", mnemonic);
-            break;
-        case address_mode_acc:
-            fprintf(file, "%s A\n", mnemonic);
-            break;
-        case address_mode_imm:
-            fprintf(file, "%s #$%02x\n", mnemonic, byte);
-            break;
         case address_mode_ind:
-            fprintf(file, "%s ($%04x)\n", mnemonic, word);
-            break;
-        case address_mode_ind_x:
-            fprintf(file, "%s ($%02x,X)\n", mnemonic, byte);
-            break;
-        case address_mode_ind_y:
-            fprintf(file, "%s ($%02x),Y\n", mnemonic, byte);
-            break;
-        case address_mode_rel:
-            fprintf(file, "%s $%04x\n", mnemonic, rel);
-            break;
-        case address_mode_zp:
-            fprintf(file, "%s $%02x\n", mnemonic, byte);
-            break;
-        case address_mode_zp_x:
-            fprintf(file, "%s $%02x,X\n", mnemonic, byte);
-            break;
-        case address_mode_zp_y:
-            fprintf(file, "%s $%02x,Y\n", mnemonic, byte);
-            break;
+            return 3;
         default:
-            assert(!"invalid code path");
-            break;
+            return 2;
     }
-
-    return opcodes[id].length;
 }
 
-void disasm_program(unsigned char *bytes, int size, int base_address, FILE *file)
+constexpr bool opcode_lengths_match_modes()
 {
-    fprintf(file, "Address  Hexdump   Dissassembly\n");
-    fprintf(file, "-------------------------------\n");
-    for (int offset = 0; offset < size; )
+    for (int i = 0; i < OPCODE_DEF_COUNT; i++)
     {
-        offset += disasm_single(bytes + base_address, offset, base_address, file);
+        if (opcode_defs[i].length != mode_length(opcode_defs[i].mode))
+        {
+            return false;
+        }
     }
+    return true;
 }
 
-void init()
+constexpr bool same_mnemonic(const char *a, const char *b)
 {
-    for (int i = 0; i < 256; i++)
-    {
-        init_opcode(i, "???", 1, address_mode_imp);
-    }
-
-    init_opcode(0x69, "ADC", 2, address_mode_imm);
-    init_opcode(0x65, "ADC", 2, address_mode_zp);
-    init_opcode(0x75, "ADC", 2, address_mode_zp_x);
-    init_opcode(0x6D, "ADC", 3, address_mode_abs);
-    init_opcode(0x7D, "ADC", 3, address_mode_abs_x);
-    init_opcode(0x79, "ADC", 3, address_mode_abs_y);
-    init_opcode(0x61, "ADC", 2, address_mode_ind_x);
-    init_opcode(0x71, "ADC", 2, address_mode_ind_y);
-    init_opcode(0x29, "AND", 2, address_mode_imm);
-    init_opcode(0x25, "AND", 2, address_mode_zp);
-    init_opcode(0x35, "AND", 2, address_mode_zp_x);
-    init_opcode(0x2D, "AND", 3, address_mode_abs);
-    init_opcode(0x3D, "AND", 3, address_mode_abs_x);
-    init_opcode(0x39, "AND", 3, address_mode_abs_y);
-    init_opcode(0x21, "AND", 2, address_mode_ind_x);
-    init_opcode(0x31, "AND", 2, address_mode_ind_y);
-    init_opcode(0x0A, "ASL", 1, address_mode_acc);
-    init_opcode(0x06, "ASL", 2, address_mode_zp);
-    init_opcode(0x16, "ASL", 2, address_mode_zp_x);
-    init_opcode(0x0E, "ASL", 3, address_mode_abs);
-    init_opcode(0x1E, "ASL", 3, address_mode_abs_x);
-    init_opcode(0x24, "BIT", 2, address_mode_zp);
-    init_opcode(0x2C, "BIT", 3, address_mode_abs);
-    init_opcode(0x00, "BRK", 1, address_mode_imp);
-    init_opcode(0xC9, "CMP", 2, address_mode_imm);
-    init_opcode(0xC5, "CMP", 2, address_mode_zp);
-    init_opcode(0xD5, "CMP", 2, address_mode_zp_x);
-    init_opcode(0xCD, "CMP", 3, address_mode_abs);
-    init_opcode(0xDD, "CMP", 3, address_mode_abs_x);
-    init_opcode(0xD9, "CMP", 3, address_mode_abs_y);
-    init_opcode(0xC1, "CMP", 2, address_mode_ind_x);
-    init_opcode(0xD1, "CMP", 2, address_mode_ind_y);
-    init_opcode(0xE0, "CPX", 2, address_mode_imm);
-    init_opcode(0xE4, "CPX", 2, address_mode_zp);
-    init_opcode(0xEC, "CPX", 3, address_mode_abs);
-    init_opcode(0xC0, "CPY", 2, address_mode_imm);
-    init_opcode(0xC4, "CPY", 2, address_mode_zp);
-    init_opcode(0xCC, "CPY", 3, address_mode_abs);
-    init_opcode(0xC6, "DEC", 2, address_mode_zp);
-    init_opcode(0xD6, "DEC", 2, address_mode_zp_x);
-    init_opcode(0xCE, "DEC", 3, address_mode_abs);
-    init_opcode(0xDE, "DEC", 3, address_mode_abs_x);
-    init_opcode(0x42, "WDM", 2, address_mode_imm); // 65C816
-    init_opcode(0x49, "EOR", 2, address_mode_imm);
-    init_opcode(0x45, "EOR", 2, address_mode_zp);
-    init_opcode(0x55, "EOR", 2, address_mode_zp_x);
-    init_opcode(0x4D, "EOR", 3, address_mode_abs);
-    init_opcode(0x5D, "EOR", 3, address_mode_abs_x);
-    init_opcode(0x59, "EOR", 3, address_mode_abs_y);
-    init_opcode(0x41, "EOR", 2, address_mode_ind_x);
-    init_opcode(0x51, "EOR", 2, address_mode_ind_y);
-    init_opcode(0xE6, "INC", 2, address_mode_zp);
-    init_opcode(0xF6, "INC", 2, address_mode_zp_x);
-    init_opcode(0xEE, "INC", 3, address_mode_abs);
-    init_opcode(0xFE, "INC", 3, address_mode_abs_x);
-    init_opcode(0x4C, "JMP", 3, address_mode_abs);
-    init_opcode(0x6C, "JMP", 3, address_mode_ind);
-    init_opcode(0x20, "JSR", 3, address_mode_abs);
-    init_opcode(0xA9, "LDA", 2, address_mode_imm);
-    init_opcode(0xA5, "LDA", 2, address_mode_zp);
-    init_opcode(0xB5, "LDA", 2, address_mode_zp_x);
-    init_opcode(0xAD, "LDA", 3, address_mode_abs);
-    init_opcode(0xBD, "LDA", 3, address_mode_abs_x);
-    init_opcode(0xB9, "LDA", 3, address_mode_abs_y);
-    init_opcode(0xA1, "LDA", 2, address_mode_ind_x);
-    init_opcode(0xB1, "LDA", 2, address_mode_ind_y);
-    init_opcode(0xA2, "LDX", 2, address_mode_imm);
-    init_opcode(0xA6, "LDX", 2, address_mode_zp);
-    init_opcode(0xB6, "LDX", 2, address_mode_zp_y);
-    init_opcode(0xAE, "LDX", 3, address_mode_abs);
-    init_opcode(0xBE, "LDX", 3, address_mode_abs_y);
-    init_opcode(0xA0, "LDY", 2, address_mode_imm);
-    init_opcode(0xA4, "LDY", 2, address_mode_zp);
-    init_opcode(0xB4, "LDY", 2, address_mode_zp_x);
-    init_opcode(0xAC, "LDY", 3, address_mode_abs);
-    init_opcode(0xBC, "LDY", 3, address_mode_abs_x);
-    init_opcode(0x4A, "LSR", 1, address_mode_acc);
-    init_opcode(0x46, "LSR", 2, address_mode_zp);
-    init_opcode(0x56, "LSR", 2, address_mode_zp_x);
-    init_opcode(0x4E, "LSR", 3, address_mode_abs);
-    init_opcode(0x5E, "LSR", 3, address_mode_abs_x);
-    init_opcode(0xEA, "NOP", 1, address_mode_imp);
-    init_opcode(0x09, "ORA", 2, address_mode_imm);
-    init_opcode(0x05, "ORA", 2, address_mode_zp);
-    init_opcode(0x15, "ORA", 2, address_mode_zp_x);
-    init_opcode(0x0D, "ORA", 3, address_mode_abs);
-    init_opcode(0x1D, "ORA", 3, address_mode_abs_x);
-    init_opcode(0x19, "ORA", 3, address_mode_abs_y);
-    init_opcode(0x01, "ORA", 2, address_mode_ind_x);
-    init_opcode(0x11, "ORA", 2, address_mode_ind_y);
-    init_opcode(0x2A, "ROL", 1, address_mode_acc);
-    init_opcode(0x26, "ROL", 2, address_mode_zp);
-    init_opcode(0x36, "ROL", 2, address_mode_zp_x);
-    init_opcode(0x2E, "ROL", 3, address_mode_abs);
-    init_opcode(0x3E, "ROL", 3, address_mode_abs_x);
-    init_opcode(0x6A, "ROR", 1, address_mode_acc);
-    init_opcode(0x66, "ROR", 2, address_mode_zp);
-    init_opcode(0x76, "ROR", 2, address_mode_zp_x);
-    init_opcode(0x6E, "ROR", 3, address_mode_abs);
-    init_opcode(0x7E, "ROR", 3, address_mode_abs_x);
-    init_opcode(0x40, "RTI", 1, address_mode_imp);
-    init_opcode(0x60, "RTS", 1, address_mode_imp);
-    init_opcode(0xE9, "SBC", 2, address_mode_imm);
-    init_opcode(0xE5, "SBC", 2, address_mode_zp);
-    init_opcode(0xF5, "SBC", 2, address_mode_zp_x);
-    init_opcode(0xED, "SBC", 3, address_mode_abs);
-    init_opcode(0xFD, "SBC", 3, address_mode_abs_x);
-    init_opcode(0xF9, "SBC", 3, address_mode_abs_y);
-    init_opcode(0xE1, "SBC", 2, address_mode_ind_x);
-    init_opcode(0xF1, "SBC", 2, address_mode_ind_y);
-    init_opcode(0x85, "STA", 2, address_mode_zp);
-    init_opcode(0x95, "STA", 2, address_mode_zp_x);
-    init_opcode(0x8D, "STA", 3, address_mode_abs);
-    init_opcode(0x9D, "STA", 3, address_mode_abs_x);
-    init_opcode(0x99, "STA", 3, address_mode_abs_y);
-    init_opcode(0x81, "STA", 2, address_mode_ind_x);
-    init_opcode(0x91, "STA", 2, address_mode_ind_y);
-    init_opcode(0x86, "STX", 2, address_mode_zp);
-    init_opcode(0x96, "STX", 2, address_mode_zp_y);
-    init_opcode(0x8E, "STX", 3, address_mode_abs);
-    init_opcode(0x84, "STY", 2, address_mode_zp);
-    init_opcode(0x94, "STY", 2, address_mode_zp_x);
-    init_opcode(0x8C, "STY", 3, address_mode_abs);
-    init_opcode(0x10, "BPL", 2, address_mode_rel);
-    init_opcode(0x30, "BMI", 2, address_mode_rel);
-    init_opcode(0x50, "BVC", 2, address_mode_rel);
-    init_opcode(0x70, "BVS", 2, address_mode_rel);
-    init_opcode(0x90, "BCC", 2, address_mode_rel);
-    init_opcode(0xB0, "BCS", 2, address_mode_rel);
-    init_opcode(0xD0, "BNE", 2, address_mode_rel);
-    init_opcode(0xF0, "BEQ", 2, address_mode_rel);
-    init_opcode(0xAA, "TAX", 1, address_mode_imp);
-    init_opcode(0x8A, "TXA", 1, address_mode_imp);
-    init_opcode(0xCA, "DEX", 1, address_mode_imp);
-    init_opcode(0xE8, "INX", 1, address_mode_imp);
-    init_opcode(0xA8, "TAY", 1, address_mode_imp);
-    init_opcode(0x98, "TYA", 1, address_mode_imp);
-    init_opcode(0x88, "DEY", 1, address_mode_imp);
-    init_opcode(0xC8, "INY", 1, address_mode_imp);
-    init_opcode(0x18, "CLC", 1, address_mode_imp);
-    init_opcode(0x38, "SEC", 1, address_mode_imp);
-    init_opcode(0x58, "CLI", 1, address_mode_imp);
-    init_opcode(0x78, "SEI", 1, address_mode_imp);
-    init_opcode(0xB8, "CLV", 1, address_mode_imp);
-    init_opcode(0xD8, "CLD", 1, address_mode_imp);
-    init_opcode(0xF8, "SED", 1, address_mode_imp);
-    init_opcode(0x9A, "TXS", 1, address_mode_imp);
-    init_opcode(0xBA, "TSX", 1, address_mode_imp);
-    init_opcode(0x48, "PHA", 1, address_mode_imp);
-    init_opcode(0x68, "PLA", 1, address_mode_imp);
-    init_opcode(0x08, "PHP", 1, address_mode_imp);
-    init_opcode(0x28, "PLP", 1, address_mode_imp);
+    return (a[0] == b[0]) && (a[1] == b[1]) && (a[2] == b[2]);
 }
 
-void disasm_test()
+constexpr bool opcode_encodings_unique()
 {
-    //unsigned char example[] = { 0xa9, 0xc0, 0xaa, 0xe8, 0x69, 0xc4, 0x00 };
-    //unsigned char example[] = { 0xa9, 0x00, 0x8d, 0x00, 0x02, 0xa9, 0x01, 0x8d, 0x01, 0x02, 0x8d, 0xff, 0x05 };
-    //unsigned char example[] = { 0xa9, 0x80, 0x85, 0x01, 0x65, 0x01, 0xa9, 0xf1, 0xaa, 0xa9, 0xf2, 0xa8, 0xa9, 0x00, 0x98, 0x8a };
-    //unsigned char example[] = { 0xa9, 0x03, 0x85, 0x00, 0xa9, 0x09, 0x38, 0xe5, 0x00, 0x85, 0x01 };
-    //unsigned char example[] = { 0xa2, 0x08, 0xca, 0x8e, 0x00, 0x02, 0xe0, 0x03, 0xf0, 0x03, 0x4c, 0x02, 0x06, 0x8e, 0x01, 0x02 };
-    //unsigned char example[] = { 0xa2, 0x08, 0xca, 0x8e, 0x00, 0x02, 0xe0, 0x03, 0xd0, 0xf8, 0x8e, 0x01, 0x02, 0x00, 0xff };
-    //unsigned char example[] = { 0xa2, 0x02, 0x8e, 0x00, 0x02, 0xa9, 0xf0, 0x6d, 0x00, 0x02, 0x90, 0xfb, 0x8e, 0x01, 0x02, 0x00 };
-    //unsigned char example[] = { 0xa2, 0x00, 0xa0, 0x00, 0x8a, 0x99, 0x00, 0x02, 0x48, 0xe8, 0xc8, 0xc0, 0x10, 0xd0, 0xf5, 0x68, 0x99, 0x00, 0x02, 0xc8, 0xc0, 0x20, 0xd0, 0xf7 };
-    //unsigned char example[] = { 0x20, 0x09, 0x06, 0x20, 0x0c, 0x06, 0x20, 0x12, 0x06, 0xa2, 0x00, 0x60, 0xe8, 0xe0, 0x05, 0xd0, 0xfb, 0x60, 0x00 };
-    //unsigned char example[] = { 0x20, 0x06, 0x06, 0x20, 0x38, 0x06, 0x20, 0x0d, 0x06, 0x20, 0x2a, 0x06, 0x60, 0xa9, 0x02, 0x85, 0x02, 0xa9, 0x04, 0x85, 0x03, 0xa9, 0x11, 0x85, 0x10, 0xa9, 0x10, 0x85, 0x12, 0xa9, 0x0f, 0x85, 0x14, 0xa9, 0x04, 0x85, 0x11, 0x85, 0x13, 0x85, 0x15, 0x60, 0xa5, 0xfe, 0x85, 0x00, 0xa5, 0xfe, 0x29, 0x03, 0x18, 0x69, 0x02, 0x85, 0x01, 0x60, 0x20, 0x4d, 0x06, 0x20, 0x8d, 0x06, 0x20, 0xc3, 0x06, 0x20, 0x19, 0x07, 0x20, 0x20, 0x07, 0x20, 0x2d, 0x07, 0x4c, 0x38, 0x06, 0xa5, 0xff, 0xc9, 0x77, 0xf0, 0x0d, 0xc9, 0x64, 0xf0, 0x14, 0xc9, 0x73, 0xf0, 0x1b, 0xc9, 0x61, 0xf0, 0x22, 0x60, 0xa9, 0x04, 0x24, 0x02, 0xd0, 0x26, 0xa9, 0x01, 0x85, 0x02, 0x60, 0xa9, 0x08, 0x24, 0x02, 0xd0, 0x1b, 0xa9, 0x02, 0x85, 0x02, 0x60, 0xa9, 0x01, 0x24, 0x02, 0xd0, 0x10, 0xa9, 0x04, 0x85, 0x02, 0x60, 0xa9, 0x02, 0x24, 0x02, 0xd0, 0x05, 0xa9, 0x08, 0x85, 0x02, 0x60, 0x60, 0x20, 0x94, 0x06, 0x20, 0xa8, 0x06, 0x60, 0xa5, 0x00, 0xc5, 0x10, 0xd0, 0x0d, 0xa5, 0x01, 0xc5, 0x11, 0xd0, 0x07, 0xe6, 0x03, 0xe6, 0x03, 0x20, 0x2a, 0x06, 0x60, 0xa2, 0x02, 0xb5, 0x10, 0xc5, 0x10, 0xd0, 0x06, 0xb5, 0x11, 0xc5, 0x11, 0xf0, 0x09, 0xe8, 0xe8, 0xe4, 0x03, 0xf0, 0x06, 0x4c, 0xaa, 0x06, 0x4c, 0x35, 0x07, 0x60, 0xa6, 0x03, 0xca, 0x8a, 0xb5, 0x10, 0x95, 0x12, 0xca, 0x10, 0xf9, 0xa5, 0x02, 0x4a, 0xb0, 0x09, 0x4a, 0xb0, 0x19, 0x4a, 0xb0, 0x1f, 0x4a, 0xb0, 0x2f, 0xa5, 0x10, 0x38, 0xe9, 0x20, 0x85, 0x10, 0x90, 0x01, 0x60, 0xc6, 0x11, 0xa9, 0x01, 0xc5, 0x11, 0xf0, 0x28, 0x60, 0xe6, 0x10, 0xa9, 0x1f, 0x24, 0x10, 0xf0, 0x1f, 0x60, 0xa5, 0x10, 0x18, 0x69, 0x20, 0x85, 0x10, 0xb0, 0x01, 0x60, 0xe6, 0x11, 0xa9, 0x06, 0xc5, 0x11, 0xf0, 0x0c, 0x60, 0xc6, 0x10, 0xa5, 0x10, 0x29, 0x1f, 0xc9, 0x1f, 0xf0, 0x01, 0x60, 0x4c, 0x35, 0x07, 0xa0, 0x00, 0xa5, 0xfe, 0x91, 0x00, 0x60, 0xa6, 0x03, 0xa9, 0x00, 0x81, 0x10, 0xa2, 0x00, 0xa9, 0x01, 0x81, 0x10, 0x60, 0xa2, 0x00, 0xea, 0xea, 0xca, 0xd0, 0xfb, 0x60 };
-    unsigned char example[] = { 0x20, 0x06, 0x06, 0x20, 0x37, 0x06, 0x20, 0x0d, 0x06, 0x20, 0x2a, 0x06, 0x60, 0xa9, 0x02, 0x85, 0x02, 0xa9, 0x04, 0x85, 0x03, 0xa9, 0x11, 0x85, 0x10, 0xa9, 0x10, 0x85, 0x12, 0xa9, 0x0f, 0x85, 0x14, 0xa9, 0x04, 0x85, 0x11, 0x85, 0x13, 0x85, 0x15, 0x60, 0xa5, 0xfe, 0x85, 0x00, 0xa5, 0xfe, 0x29, 0x03, 0x18, 0x69, 0x02, 0x85, 0x01, 0x20, 0x57, 0x06, 0x20, 0x43, 0x06, 0x20, 0x4a, 0x06, 0x4c, 0x37, 0x06, 0xa0, 0x00, 0xa5, 0xfe, 0x91, 0x00, 0x60, 0xa6, 0x03, 0xa9, 0x00, 0x81, 0x10, 0xa2, 0x00, 0xa9, 0x01, 0x81, 0x10, 0x60, 0xa6, 0x03, 0xca, 0x8a, 0xb5, 0x10, 0x95, 0x12, 0xca, 0x10, 0xf9, 0xa5, 0x02, 0x4a, 0xb0, 0x09, 0x4a, 0xb0, 0x19, 0x4a, 0xb0, 0x1f, 0x4a, 0xb0, 0x2f, 0xa5, 0x10, 0x38, 0xe9, 0x20, 0x85, 0x10, 0x90, 0x01, 0x60, 0xc6, 0x11, 0xa9, 0x01, 0xc5, 0x11, 0xf0, 0x26, 0x60, 0xe6, 0x10, 0xa9, 0x1f, 0x24, 0x10, 0xf0, 0x1d, 0x60, 0xa5, 0x10, 0x18, 0x69, 0x20, 0x85, 0x10, 0xb0, 0x01, 0x60, 0xe6, 0x11, 0xa9, 0x06, 0xc5, 0x11, 0xf0, 0x0a, 0x60, 0xc6, 0x10, 0xa9, 0x1f, 0x25, 0x10, 0xf0, 0x01, 0x60, 0x4c, 0xab, 0x06 };
-
-    disasm_program(example, sizeof(example), 0x600, stdout);
+    for (int i = 0; i < OPCODE_DEF_COUNT; i++)
+    {
+        for (int j = i + 1; j < OPCODE_DEF_COUNT; j++)
+        {
+            if (opcode_defs[i].id == opcode_defs[j].id)
+            {
+                return false;
+            }
+            if ((opcode_defs[i].mode == opcode_defs[j].mode) && same_mnemonic(opcode_defs[i].mnemonic, opcode_defs[j].mnemonic))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
 }
 
-struct parsed_line
-{
-    char label[64];
-    char op[64];
-    char args[256];
-};
-
-void parse_line(const char *line, int length, parsed_line *parsed)
+constexpr bool opcode_mnemonics_valid()
 {
-    int start, end, pos = 0;
-
-    memset(parsed, 0, sizeof(parsed_line));
-
-    while ((line[pos] == ' ') || (line[pos] == '\t'))
+    for (int i = 0; i < OPCODE_DEF_COUNT; i++)
     {
-        pos++;
+        const char *m = opcode_defs[i].mnemonic;
+        for (int c = 0; c < 3; c++)
+        {
+            if ((m[c] < 'A') || (m[c] > 'Z'))
+            {
+                return false;
+            }
+        }
+        if ((m[3] != 0) || (opcode_defs[i].id < 0) || (opcode_defs[i].id > 0xFF))
+        {
+            return false;
+        }
     }
+    return true;
+}
 
-    // special case - set address *=$12AB
-    if ((line[pos] == '*') && (line[pos + 1] == '='))
+constexpr bool opcode_penalties_match_modes()
+{
+    for (int i = 0; i < OPCODE_DEF_COUNT; i++)
     {
-        parsed->op[0] = '*';
-        pos += 2;
-        start = pos;
-
-        while ((line[pos] != ';') && (line[pos] != '\n') && (line[pos] != '\r') && (line[pos] != 0))
+        address_mode mode = opcode_defs[i].mode;
+        cycle_penalty penalty = opcode_defs[i].penalty;
+        if ((penalty == penalty_branch) != (mode == address_mode_rel))
         {
-            pos++;
+            return false;
+        }
+        if ((penalty == penalty_page) && (mode != address_mode_abs_x) && (mode != address_mode_abs_y) && (mode != address_mode_ind_y))
+        {
+            return false;
         }
-        end = pos;
-
-        strncpy_s(parsed->args, sizeof(parsed->args), &line[start], end - start);
-        return;
     }
+    return true;
+}
 
-    start = pos;
-    while ((line[pos] == '_') || ((line[pos] >= 'A') && (line[pos] <= 'Z')) || ((line[pos] >= 'a') && (line[pos] <= 'z')) || ((line[pos] >= '0') && (line[pos] <= '9')))
+static_assert(opcode_lengths_match_modes(), "opcode length does not match its address mode");
+static_assert(opcode_penalties_match_modes(), "cycle penalty does not match the address mode");
+static_assert(opcode_encodings_unique(), "duplicate opcode byte or mnemonic/mode pair");
+static_assert(opcode_mnemonics_valid(), "mnemonics must be 3 upper case letters");
+
+// decode table: opcode byte -> definition ("???" for undocumented bytes)
+
+struct opcode_table
+{
+    opcode entries[256];
+};
+
+constexpr opcode_table build_opcode_table()
+{
+    opcode_table table = {};
+    for (int id = 0; id < 256; id++)
     {
-        pos++;
+        table.entries[id].mnemonic = "???";
+        table.entries[id].length = 1;
+        table.entries[id].mode = address_mode_imp;
     }
-    end = pos;
-
-    while ((line[pos] == ' ') || (line[pos] == '\t'))
+    for (int i = 0; i < OPCODE_DEF_COUNT; i++)
     {
-        pos++;
+        opcode *op = &table.entries[opcode_defs[i].id];
+        op->mnemonic = opcode_defs[i].mnemonic;
+        op->length = opcode_defs[i].length;
+        op->mode = opcode_defs[i].mode;
+        op->cycles = opcode_defs[i].cycles;
+        op->penalty = opcode_defs[i].penalty;
     }
+    return table;
+}
+
+constexpr opcode_table opcode_table_data = build_opcode_table();
+constexpr const opcode (&opcodes)[256] = opcode_table_data.entries;
+
+// listing lines are formatted into a large buffer that is flushed to the file in big chunks
+// (or grows, if there is no file)
+
+struct output_buffer
+{
+    char *data;
+    int used;
+    int capacity;
+    FILE *file;
+    long long written; // bytes already flushed to file
+};
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+
+void output_init(output_buffer *out, FILE *file, int capacity)
+{
+    out->data = (char *)malloc(capacity);
+    out->used = 0;
+    out->capacity = capacity;
+    out->file = file;
+    out->written = 0;
+}
 
-    if (line[pos] != ':')
+void output_flush(output_buffer *out)
+{
+    if (out->file && out->used)
     {
-        strncpy_s(parsed->op, sizeof(parsed->op), &line[start], end - start);
+        fwrite(out->data, 1, out->used, out->file);
+        out->written += out->used;
+        out->used = 0;
     }
-    else
-    {
-        strncpy_s(parsed->label, sizeof(parsed->label), &line[start], end - start);
-        pos++;
-
-        while ((line[pos] == ' ') || (line[pos] == '\t'))
-        {
-            pos++; 
-        }
+}
 
-        start = pos;
-        while ((line[pos] == '_') || ((line[pos] >= 'A') && (line[pos] <= 'Z')) || ((line[pos] >= 'a') && (line[pos] <= 'z')) || ((line[pos] >= '0') && (line[pos] <= '9')))
+// returns the write position, with at least size bytes available
+char *output_reserve(output_buffer *out, int size)
+{
+    if (out->used + size > out->capacity)
+    {
+        output_flush(out);
+        if (out->used + size > out->capacity)
         {
-            pos++;
+            while (out->used + size > out->capacity)
+            {
+                out->capacity *= 2;
+            }
+            out->data = (char *)realloc(out->data, out->capacity);
         }
-        end = pos;
-        strncpy_s(parsed->op, sizeof(parsed->op), &line[start], end - start);
     }
+    return out->data + out->used;
+}
 
-    while ((line[pos] == ' ') || (line[pos] == '\t'))
-    {
-        pos++;
-    }
+void output_text(output_buffer *out, const char *text)
+{
+    int length = (int)strlen(text);
+    memcpy(output_reserve(out, length), text, length);
+    out->used += length;
+}
 
-    start = pos;
-    while ((line[pos] != ';') && (line[pos] != '\n') && (line[pos] != '\r') && (line[pos] != 0))
+void output_write(output_buffer *out, const char *data, int size)
+{
+    if (out->file && (size > out->capacity / 2))
     {
-        pos++;
+        output_flush(out);
+        fwrite(data, 1, size, out->file);
+        out->written += size;
+        return;
     }
-    end = pos;
+    memcpy(output_reserve(out, size), data, size);
+    out->used += size;
+}
 
-    strncpy_s(parsed->args, sizeof(parsed->args), &line[start], end - start);
+void output_free(output_buffer *out)
+{
+    output_flush(out);
+    free(out->data);
+    *out = {};
 }
 
-struct symbol
+// per-opcode listing templates, e.g. "LDA ($" + byte operand + "),Y\n"
+
+enum operand_format
 {
-    char *label;
-    int offset;
-    symbol *next;
+    operand_none,
+    operand_byte,
+    operand_word,
+    operand_rel,
 };
 
-symbol *labels = 0;
-symbol *defines = 0;
+struct disasm_template
+{
+    char text[16];
+    char suffix[8];
+    unsigned char text_length;
+    unsigned char suffix_length;
+    unsigned char operand;
+};
 
-// TODO: check for duplicate labels
+#define DISASM_MAX_LINE 64
 
-symbol *add_symbol(symbol *list, char *text, int offset)
+struct disasm_template_table
 {
-    symbol *s = (symbol *)malloc(sizeof(symbol));
-    size_t size = strlen(text) + 1;
-    s->label = (char *)malloc(size);
-    strcpy_s(s->label, size, text);
-    s->offset = offset;
-    s->next = list;
-    return s;
-}
-
-#define INVALID_ADDRESS 0xFFFFF
+    disasm_template entries[256];
+    char hex_pairs[256][2];
+};
 
-int lookup_symbol(symbol *list, const char *text)
+constexpr int append_text(char *dest, int at, const char *text)
 {
-    for (symbol *s = list; s; s = s->next)
+    while (*text)
     {
-        if (_stricmp(text, s->label) == 0)
-        {
-            return s->offset;
-        }
+        dest[at++] = *text++;
     }
-    return INVALID_ADDRESS;
+    return at;
 }
 
-void free_symbols(symbol **list)
+constexpr disasm_template_table build_disasm_templates()
 {
-    for (symbol *s = *list, *next = 0; s; s = next)
+    disasm_template_table table = {};
+    const char *digits = "0123456789abcdef";
+    for (int i = 0; i < 256; i++)
     {
-        next = s->next;
-        free(s->label);
-        free(s);
+        table.hex_pairs[i][0] = digits[i >> 4];
+        table.hex_pairs[i][1] = digits[i & 0xF];
     }
-    *list = 0;
-}
 
-int lookup(const char *text)
-{
-    int address = lookup_symbol(defines, text);
-    if (address == INVALID_ADDRESS)
+    for (int id = 0; id < 256; id++)
     {
-        address = lookup_symbol(labels, text);
+        const char *prefix = "";
+        const char *suffix = "\n";
+        operand_format operand = operand_none;
+
+        switch (opcodes[id].mode)
+        {
+            case address_mode_abs:   prefix = " $";  operand = operand_word; break;
+            case address_mode_abs_x: prefix = " $";  operand = operand_word; suffix = ",X\n"; break;
+            case address_mode_abs_y: prefix = " $";  operand = operand_word; suffix = ",Y\n"; break;
+            case address_mode_imp:   break;
+            case address_mode_acc:   prefix = " A"; break;
+            case address_mode_imm:   prefix = " #$"; operand = operand_byte; break;
+            case address_mode_ind:   prefix = " ($"; operand = operand_word; suffix = ")\n"; break;
+            case address_mode_ind_x: prefix = " ($"; operand = operand_byte; suffix = ",X)\n"; break;
+            case address_mode_ind_y: prefix = " ($"; operand = operand_byte; suffix = "),Y\n"; break;
+            case address_mode_rel:   prefix = " $";  operand = operand_rel; break;
+            case address_mode_zp:    prefix = " $";  operand = operand_byte; break;
+            case address_mode_zp_x:  prefix = " $";  operand = operand_byte; suffix = ",X\n"; break;
+            case address_mode_zp_y:  prefix = " $";  operand = operand_byte; suffix = ",Y\n"; break;
+            default: break;
+        }
+
+        disasm_template *t = &table.entries[id];
+        int length = append_text(t->text, 0, opcodes[id].mnemonic);
+        t->text_length = (unsigned char)append_text(t->text, length, prefix);
+        t->suffix_length = (unsigned char)append_text(t->suffix, 0, suffix);
+        t->operand = (unsigned char)operand;
     }
-    return address;
+    return table;
+}
+
+constexpr disasm_template_table disasm_template_data = build_disasm_templates();
+constexpr const disasm_template (&disasm_templates)[256] = disasm_template_data.entries;
+constexpr const char (&hex_pairs)[256][2] = disasm_template_data.hex_pairs;
+
+inline char *put_hex_byte(char *p, unsigned int value)
+{
+    p[0] = hex_pairs[value & 0xFF][0];
+    p[1] = hex_pairs[value & 0xFF][1];
+    return p + 2;
 }
 
-void print_symbols(symbol *list)
+// same as "%04x"
+inline char *put_hex_word(char *p, unsigned int value)
 {
-    for (symbol *s = list; s; s = s->next)
+    if (value > 0xFFFF)
     {
-        printf("%04x    %s\n", s->offset, s->label);
+        int digits = 5;
+        while ((digits < 8) && (value >> (digits * 4)))
+        {
+            digits++;
+        }
+        for (int i = digits - 1; i >= 0; i--)
+        {
+            *p++ = hex_pairs[(value >> (i * 4)) & 0xF][1];
+        }
+        return p;
     }
+    p = put_hex_byte(p, value >> 8);
+    return put_hex_byte(p, value);
 }
 
-int parse_value(const char *text)
+int disasm_single(const unsigned char *bytes, int offset, int size, int base_address, output_buffer *out)
 {
-    int value = 0;
-    if (*text == '$')
+    int id = bytes[offset];
+    int length = opcodes[id].length;
+    const disasm_template *t = &disasm_templates[id];
+
+    unsigned int address = offset + base_address;
+
+    char *start = output_reserve(out, DISASM_MAX_LINE);
+    char *p = start;
+
+    *p++ = '$';
+    p = put_hex_word(p, address);
+    memcpy(p, "    ", 4);
+    p += 4;
+
+    // special case: instruction truncated by the end of the buffer
+    if (offset + length > size)
     {
-        text++; // skip hex prefix
-        for (;;)
+        length = size - offset;
+        for (int i = 0; i < 3; i++)
         {
-            if ((*text >= '0') && (*text <= '9'))
-            {
-                value = value * 16 + (*text - '0');
-                text++;
-            }
-            else if ((*text >= 'A') && (*text <= 'F'))
-            {
-                value = value * 16 + (*text - 'A' + 10);
-                text++;
-            }
-            else if ((*text >= 'a') && (*text <= 'f'))
+            if (i < length)
             {
-                value = value * 16 + (*text - 'a' + 10);
-                text++;
+                p = put_hex_byte(p, bytes[offset + i]);
             }
             else
             {
-                break;
+                p[0] = p[1] = ' ';
+                p += 2;
             }
+            *p++ = ' ';
         }
+        memcpy(p, " ???\n", 5);
+        p += 5;
+        out->used += (int)(p - start);
+        return length;
     }
-    else
+
+    // hexdump, always 10 columns
+    memset(p, ' ', 10);
+    for (int i = 0; i < length; i++)
     {
-        for (;;)
-        {
-            if ((*text >= '0') && (*text <= '9'))
-            {
-                value = value * 10 + (*text - '0');
-                text++;
-            }
-            else
-            {
-                break;
-            }
-        }
+        put_hex_byte(p + i * 3, bytes[offset + i]);
     }
-    return value;
+    p += 10;
+
+    memcpy(p, t->text, 16);
+    p += t->text_length;
+
+    unsigned int byte = (length > 1) ? bytes[offset + 1] : 0;
+    switch (t->operand)
+    {
+        case operand_byte:
+            p = put_hex_byte(p, byte);
+            break;
+        case operand_word:
+            p = put_hex_byte(p, bytes[offset + 2]);
+            p = put_hex_byte(p, byte);
+            break;
+        case operand_rel:
+            p = put_hex_word(p, address + 2 + (signed char)byte);
+            break;
+    }
+
+    memcpy(p, t->suffix, 8);
+    p += t->suffix_length;
+
+    out->used += (int)(p - start);
+    return length;
 }
 
-address_mode get_address_mode(const char *args, int *ptr_address)
+// parallel disassembly: the image is split into chunks decoded by separate threads
+// the real instruction boundary at a chunk start is only known once the previous chunk is done,
+// so each chunk is decoded from start + 0 and, up to the point where they rejoin that path,
+// from start + 1 and start + 2 as well. the join then picks the one matching the previous chunk.
+
+struct disasm_chunk
 {
-    address_mode mode = address_mode_undef;
-    int address = 0;
-    const char *c = args;
+    int start;
+    int end;
+    output_buffer main;       // listing from start + 0
+    output_buffer prefix[3];  // listing from start + 1/2 until it rejoins the main path
+    bool synced[3];
+    int sync_offset[3];       // first offset shared with the main path
+    int sync_position[3];     // main.used at sync_offset
+    int sync_count[3];        // main path instructions before sync_offset
+    int exit_offset[3];       // first offset after the chunk
+    int main_count;           // instructions listed in main
+    int prefix_count[3];      // and in prefix
+};
 
-#define _skip_spaces while ((*c == ' ') || (*c == '\t')) {c++;}
+thread_local int disasm_threads = 1; // -t, per thread so server connections can differ
 
-    _skip_spaces;
+#define DISASM_PARALLEL_MIN_SIZE (64 * 1024)
+#define DISASM_MIN_CHUNK_SIZE (16 * 1024)
 
-    if (*c == 0)
+void disasm_chunk_worker(const unsigned char *bytes, int size, int base_address, disasm_chunk *chunk)
+{
+    int start = chunk->start;
+    int end = chunk->end;
+
+    // find where the alternative start offsets rejoin the main path (lengths only)
+    for (int c = 1; c < 3; c++)
     {
-        mode = address_mode_imp;
+        chunk->synced[c] = false;
+        int a = start;
+        for (int b = start + c; b < end; b += opcodes[bytes[b]].length)
+        {
+            while (a < b)
+            {
+                a += opcodes[bytes[a]].length;
+            }
+            if (a == b)
+            {
+                chunk->synced[c] = true;
+                chunk->sync_offset[c] = b;
+                break;
+            }
+        }
     }
-    else if (((c[0] == 'A') || (c[0] == 'a')) && c[1] == 0)
+
+    int offset = start;
+    while (offset < end)
     {
-        mode = address_mode_acc;
-        c++;
+        for (int c = 1; c < 3; c++)
+        {
+            if (chunk->synced[c] && (chunk->sync_offset[c] == offset))
+            {
+                chunk->sync_position[c] = chunk->main.used;
+                chunk->sync_count[c] = chunk->main_count;
+            }
+        }
+        offset += disasm_single(bytes, offset, size, base_address, &chunk->main);
+        chunk->main_count++;
     }
-    else if (*c == '#')
+    chunk->exit_offset[0] = offset;
+
+    for (int c = 1; c < 3; c++)
     {
-        mode = address_mode_imm;
-        c++;
+        int stop = chunk->synced[c] ? chunk->sync_offset[c] : end;
+        offset = start + c;
+        while ((offset < stop) && (offset < size))
+        {
+            offset += disasm_single(bytes, offset, size, base_address, &chunk->prefix[c]);
+            chunk->prefix_count[c]++;
+        }
+        chunk->exit_offset[c] = chunk->synced[c] ? chunk->exit_offset[0] : offset;
+    }
+}
+
+int disasm_program_parallel(unsigned char *bytes, int size, int base_address, output_buffer *out, int threads)
+{
+    // no more threads than cores, and chunks big enough to be worth one
+    int cores = (int)std::thread::hardware_concurrency();
+    int chunk_count = ((cores > 0) && (threads > cores)) ? cores : threads;
+    if (chunk_count > size / DISASM_MIN_CHUNK_SIZE)
+    {
+        chunk_count = size / DISASM_MIN_CHUNK_SIZE;
     }
-    else if (*c == '(')
+    if (chunk_count < 1)
     {
-        mode = address_mode_ind;
-        c++;
+        chunk_count = 1;
     }
-    else
+    int chunk_size = (size + chunk_count - 1) / chunk_count;
+    chunk_count = (size + chunk_size - 1) / chunk_size; // every chunk starts inside the input
+    disasm_chunk *chunks = (disasm_chunk *)calloc(chunk_count, sizeof(disasm_chunk));
+    std::thread *workers = new std::thread[chunk_count];
+
+    for (int i = 0; i < chunk_count; i++)
     {
-        mode = address_mode_abs;
+        disasm_chunk *chunk = &chunks[i];
+        chunk->start = i * chunk_size;
+        chunk->end = (i + 1 == chunk_count) ? size : (i + 1) * chunk_size;
+        output_init(&chunk->main, 0, chunk_size * 24);
+        output_init(&chunk->prefix[1], 0, 1024);
+        output_init(&chunk->prefix[2], 0, 1024);
+        workers[i] = std::thread(disasm_chunk_worker, bytes, size, base_address, chunk);
     }
 
-    _skip_spaces;
+    output_text(out, "Address  Hexdump   Dissassembly\n");
+    output_text(out, "-------------------------------\n");
 
-    if (*c == '$')
+    int offset = 0;
+    int count = 0;
+    for (int i = 0; i < chunk_count; i++)
     {
-        address = parse_value(c);
-        *c++;
-        while (((*c >= '0') && (*c <= '9')) || ((*c >= 'A') && (*c <= 'F')) || ((*c >= 'a') && (*c <= 'f')))
+        disasm_chunk *chunk = &chunks[i];
+        workers[i].join();
+
+        if (offset < chunk->end)
         {
-            c++;
+            int c = offset - chunk->start;
+            assert((c >= 0) && (c < 3));
+            if (c == 0)
+            {
+                output_write(out, chunk->main.data, chunk->main.used);
+                count += chunk->main_count;
+            }
+            else
+            {
+                output_write(out, chunk->prefix[c].data, chunk->prefix[c].used);
+                count += chunk->prefix_count[c];
+                if (chunk->synced[c])
+                {
+                    output_write(out, chunk->main.data + chunk->sync_position[c], chunk->main.used - chunk->sync_position[c]);
+                    count += chunk->main_count - chunk->sync_count[c];
+                }
+            }
+            offset = chunk->exit_offset[c];
         }
+
+        output_free(&chunk->main);
+        output_free(&chunk->prefix[1]);
+        output_free(&chunk->prefix[2]);
     }
-    else if ((*c >= '0') && (*c <= '9'))
+
+    delete[] workers;
+    free(chunks);
+    return count;
+}
+
+// bytes[0] is the byte at base_address. returns the number of instructions listed
+int disasm_listing(unsigned char *bytes, int size, int base_address, output_buffer *out)
+{
+    if ((disasm_threads > 1) && (size >= DISASM_PARALLEL_MIN_SIZE))
     {
-        address = parse_value(c);
-        while ((*c >= '0') && (*c <= '9'))
-        {
-            c++;
-        }
+        return disasm_program_parallel(bytes, size, base_address, out, disasm_threads);
     }
-    else
+
+    output_text(out, "Address  Hexdump   Dissassembly\n");
+    output_text(out, "-------------------------------\n");
+    int count = 0;
+    for (int offset = 0; offset < size; count++)
     {
-        bool label_lo = false;
-        bool label_hi = false;
-        if (*c == '<')
-        {
-            label_lo = true;
-            c++;
-        }
-        else if (*c == '>')
-        {
-            label_hi = true;
-            c++;
-        }
+        offset += disasm_single(bytes, offset, size, base_address, out);
+    }
+    return count;
+}
+
+// recursive traversal: only bytes reachable from the entry points (base address and the
+// NMI/RESET/IRQ vectors) through JMP/JSR/branches are decoded as code, the rest is listed as data
+// every offset is pushed to the worklist at most once, so this is linear in the image size
+
+#define OP_BRK 0x00
+#define OP_JSR 0x20
+#define OP_RTI 0x40
+#define OP_JMP 0x4C
+#define OP_RTS 0x60
+#define OP_JMP_IND 0x6C
+
+inline bool bit_test(const unsigned char *bitmap, int i)
+{
+    return (bitmap[i >> 3] >> (i & 7)) & 1;
+}
+
+inline void bit_set(unsigned char *bitmap, int i)
+{
+    bitmap[i >> 3] |= 1 << (i & 7);
+}
+
+// sets a bit in code_starts for every reachable instruction
+void trace_code(const unsigned char *bytes, int size, int base_address, unsigned char *code_starts)
+{
+    unsigned char *visited = (unsigned char *)calloc((size + 7) / 8, 1);
+    int *worklist = (int *)malloc(size * sizeof(int));
+    int count = 0;
+
+#define _push(address) \
+    { \
+        int target = (address) - base_address; \
+        if ((target >= 0) && (target < size) && !bit_test(visited, target)) \
+        { \
+            bit_set(visited, target); \
+            worklist[count++] = target; \
+        } \
+    }
+
+    _push(base_address);
 
-        char lookup_str[64];
-        int lookup_len = 0;
-        while ((lookup_len < 63) && (*c == '_') || ((*c >= 'A') && (*c <= 'Z')) || ((*c >= 'a') && (*c <= 'z')) || ((*c >= '0') && (*c <= '9')))
+    // interrupt vectors, if the image covers them
+    for (int vector = 0xFFFA; vector < 0x10000; vector += 2)
+    {
+        int offset = vector - base_address;
+        if ((offset >= 0) && (offset + 1 < size))
         {
-            lookup_str[lookup_len++] = *c++;
+            _push(bytes[offset] | (bytes[offset + 1] << 8));
         }
-        lookup_str[lookup_len] = 0;
+    }
 
-        if (lookup_len)
+    while (count > 0)
+    {
+        int offset = worklist[--count];
+        for (;;)
         {
-            address = lookup(lookup_str);
-            if (label_lo)
+            int id = bytes[offset];
+            int length = opcodes[id].length;
+            if ((opcodes[id].mnemonic[0] == '?') || (offset + length > size))
+            {
+                break;
+            }
+            bit_set(code_starts, offset);
+
+            int address = base_address + offset;
+            if (opcodes[id].mode == address_mode_rel)
             {
-                address = address & 0xFF;
+                _push(address + 2 + (signed char)bytes[offset + 1]);
             }
-            else if (label_hi)
+            else if ((id == OP_JSR) || (id == OP_JMP))
             {
-                address = (address >> 8) & 0xFF;
+                _push(bytes[offset + 1] | (bytes[offset + 2] << 8));
             }
-        }
-    }
 
-    _skip_spaces;
+            if ((id == OP_JMP) || (id == OP_JMP_IND) || (id == OP_RTS) || (id == OP_RTI) || (id == OP_BRK))
+            {
+                break;
+            }
 
-    if (*c == ')')
-    {
-        c++;
-        _skip_spaces;
-        if (*c == ',')
-        {
-            c++;
-            _skip_spaces;
-            if ((*c == 'y') || (*c == 'Y'))
+            // fall through to the next instruction, unless it was already traced
+            offset += length;
+            if ((offset >= size) || bit_test(visited, offset))
             {
-                mode = address_mode_ind_y;
-                *c++;
+                break;
             }
+            bit_set(visited, offset);
         }
     }
 
-    if (*c == ',')
+#undef _push
+
+    free(worklist);
+    free(visited);
+}
+
+// up to 3 data bytes per line, e.g. "$0630    00 06 0c  DCB $00,$06,$0c"
+int disasm_data(const unsigned char *bytes, int offset, int length, int base_address, output_buffer *out)
+{
+    char *start = output_reserve(out, DISASM_MAX_LINE);
+    char *p = start;
+
+    *p++ = '$';
+    p = put_hex_word(p, offset + base_address);
+    memcpy(p, "    ", 4);
+    p += 4;
+
+    memset(p, ' ', 10);
+    for (int i = 0; i < length; i++)
     {
-        c++;
-        _skip_spaces;
-        if (((*c == 'x') || (*c == 'X')) && (mode == address_mode_ind))
-        {
-            mode = address_mode_ind_x;
-            c++;
-            _skip_spaces;
-            assert(*c == ')');
-            c++;
-        }
-        else if (((*c == 'x') || (*c == 'X')) && (mode == address_mode_abs))
+        put_hex_byte(p + i * 3, bytes[offset + i]);
+    }
+    p += 10;
+
+    memcpy(p, "DCB ", 4);
+    p += 4;
+    for (int i = 0; i < length; i++)
+    {
+        if (i > 0)
         {
-            mode = address_mode_abs_x;
-            c++;
+            *p++ = ',';
         }
-        else if (((*c == 'y') || (*c == 'Y')) && (mode == address_mode_abs))
+        *p++ = '$';
+        p = put_hex_byte(p, bytes[offset + i]);
+    }
+    *p++ = '\n';
+
+    out->used += (int)(p - start);
+    return length;
+}
+
+// returns the number of instructions decoded
+int disasm_traced(unsigned char *bytes, int size, int base_address, output_buffer *out)
+{
+    int instructions = 0;
+    unsigned char *code_starts = (unsigned char *)calloc((size + 7) / 8, 1);
+    trace_code(bytes, size, base_address, code_starts);
+
+    output_text(out, "Address  Hexdump   Dissassembly\n");
+    output_text(out, "-------------------------------\n");
+    for (int offset = 0; offset < size; )
+    {
+        if (bit_test(code_starts, offset))
         {
-            mode = address_mode_abs_y;
-            c++;
+            offset += disasm_single(bytes, offset, size, base_address, out);
+            instructions++;
         }
         else
         {
-            assert(!"invalid mode");
+            int length = 1;
+            while ((length < 3) && (offset + length < size) && !bit_test(code_starts, offset + length))
+            {
+                length++;
+            }
+            offset += disasm_data(bytes, offset, length, base_address, out);
         }
     }
 
-    _skip_spaces;
+    free(code_starts);
+    return instructions;
+}
 
-    assert(*c == 0);
+void disasm_program(unsigned char *bytes, int size, int base_address, FILE *file)
+{
+    output_buffer out;
+    output_init(&out, file, OUTPUT_BUFFER_SIZE);
+    disasm_listing(bytes, size, base_address, &out);
+    output_free(&out);
+}
 
-    assert(mode != address_mode_undef);
+// static cycle counts (-c). everything that can be decided from the bytes alone is:
+// a branch knows whether its target is on another page, an indexed read from a
+// page aligned base never crosses one. the rest is a best/worst range
 
-    if (ptr_address)
+struct cycle_range
+{
+    int best;         // branches not taken
+    int worst;        // branches taken
+    int taken;        // cost of a taken branch
+    bool page_crossed; // taken branch lands on another page
+};
+
+cycle_range instruction_cycles(const unsigned char *bytes, int offset, int base_address)
+{
+    const opcode *op = &opcodes[bytes[offset]];
+    cycle_range range = { op->cycles, op->cycles, op->cycles, false };
+    if (op->penalty == penalty_branch)
     {
-        *ptr_address = address;
+        int next = base_address + offset + 2;
+        int target = next + (signed char)bytes[offset + 1];
+        range.page_crossed = ((target ^ next) & 0xFF00) != 0;
+        range.taken = op->cycles + (range.page_crossed ? 2 : 1);
+        range.worst = range.taken;
     }
-    return mode;
+    else if (op->penalty == penalty_page)
+    {
+        bool aligned = (op->mode != address_mode_ind_y) && (bytes[offset + 1] == 0);
+        range.worst += aligned ? 0 : 1;
+    }
+    return range;
 }
 
-int translate_dcb(const char *args, unsigned char *out)
+#define CYCLES_COLUMN 34
+
+// the listing line of disasm_single with e.g. "; 4-5" or "; 2/4 page crossed" appended
+int disasm_single_cycles(const unsigned char *bytes, int offset, int size, int base_address, output_buffer *out)
 {
-    int pos = 0;
-    int length = 0;
+    // room for both parts, so the line is not flushed in between
+    output_reserve(out, 2 * DISASM_MAX_LINE);
+    int line = out->used;
+    int length = disasm_single(bytes, offset, size, base_address, out);
+    if (offset + opcodes[bytes[offset]].length > size)
+    {
+        return length;
+    }
 
-    for (;;)
+    out->used--; // the newline
+    int column = out->used - line;
+    char *start = out->data + out->used;
+    char *p = start;
+    if (column < CYCLES_COLUMN)
     {
-        while ((args[pos] == ' ') || (args[pos] == '\t'))
+        memset(p, ' ', CYCLES_COLUMN - column);
+        p += CYCLES_COLUMN - column;
+    }
+
+    // cycle counts are single digits
+    cycle_range range = instruction_cycles(bytes, offset, base_address);
+    p[0] = ';';
+    p[1] = ' ';
+    p[2] = (char)('0' + range.best);
+    p += 3;
+    if (opcodes[bytes[offset]].penalty == penalty_branch)
+    {
+        p[0] = '/';
+        p[1] = (char)('0' + range.taken);
+        p += 2;
+        if (range.page_crossed)
         {
-            pos++;
+            memcpy(p, " page crossed", 13);
+            p += 13;
         }
+    }
+    else if (range.worst > range.best)
+    {
+        p[0] = '-';
+        p[1] = (char)('0' + range.worst);
+        p += 2;
+    }
+    *p++ = '\n';
+    out->used += (int)(p - start);
+    return length;
+}
+
+int disasm_listing_cycles(unsigned char *bytes, int size, int base_address, output_buffer *out)
+{
+    output_text(out, "Address  Hexdump   Dissassembly\n");
+    output_text(out, "-------------------------------\n");
+    int count = 0;
+    for (int offset = 0; offset < size; count++)
+    {
+        offset += disasm_single_cycles(bytes, offset, size, base_address, out);
+    }
+    return count;
+}
+
+// every backward branch or JMP closes a loop over the instructions from its target to
+// itself. the body costs come from prefix sums over the linear sweep, so this is linear
+// in the image size however many loops there are. inner branches count as not taken for
+// the best case and taken for the worst, the closing one is always taken
+void report_loops(const unsigned char *bytes, int size, int base_address, output_buffer *out)
+{
+    int *index_at = (int *)malloc(size * sizeof(int));
+    long long *best = (long long *)malloc((size + 1) * sizeof(long long));
+    long long *worst = (long long *)malloc((size + 1) * sizeof(long long));
+    int *starts = (int *)malloc(size * sizeof(int));
+    memset(index_at, 0xFF, size * sizeof(int));
 
-        if (args[pos] != 0)
+    int count = 0;
+    best[0] = worst[0] = 0;
+    for (int offset = 0; offset < size; offset += opcodes[bytes[offset]].length)
+    {
+        if (offset + opcodes[bytes[offset]].length > size)
         {
-            out[length++] = parse_value(args + pos);
+            break;
         }
+        cycle_range range = instruction_cycles(bytes, offset, base_address);
+        index_at[offset] = count;
+        starts[count] = offset;
+        best[count + 1] = best[count] + range.best;
+        worst[count + 1] = worst[count] + range.worst;
+        count++;
+    }
 
-        while ((args[pos] != ',') && (args[pos] != '\n') && (args[pos] != 0))
+    int loops = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int offset = starts[i];
+        int id = bytes[offset];
+        int target;
+        int closing;
+        if (opcodes[id].penalty == penalty_branch)
         {
-            pos++;
+            target = base_address + offset + 2 + (signed char)bytes[offset + 1];
+            closing = instruction_cycles(bytes, offset, base_address).taken;
+        }
+        else if (id == OP_JMP)
+        {
+            target = bytes[offset + 1] | (bytes[offset + 2] << 8);
+            closing = opcodes[id].cycles;
+        }
+        else
+        {
+            continue;
+        }
+        int first = target - base_address;
+        if ((first < 0) || (first > offset) || (index_at[first] < 0))
+        {
+            continue;
         }
 
-        if ((args[pos] == '\n') || (args[pos] == 0))
+        int j = index_at[first];
+        cycle_range last = instruction_cycles(bytes, offset, base_address);
+        long long loop_best = best[i + 1] - best[j] - last.best + closing;
+        long long loop_worst = worst[i + 1] - worst[j] - last.worst + closing;
+        if (loops++ == 0)
         {
-            break;
+            output_text(out, "Loops (cycles per iteration):\n");
         }
-        else if (args[pos] == ',')
+        char *p = output_reserve(out, DISASM_MAX_LINE);
+        out->used += snprintf(p, DISASM_MAX_LINE, "$%04x-$%04x  %d instructions  %lld-%lld cycles\n",
+            target, base_address + offset, i - j + 1, loop_best, loop_worst);
+    }
+
+    free(starts);
+    free(worst);
+    free(best);
+    free(index_at);
+}
+
+#define STREAM_BUFFER_SIZE 0x10000
+
+// linear listing of input that arrives in pieces (stdin, pipes) in constant memory.
+// an instruction cut by the end of a read keeps its first bytes at the front of the
+// buffer until the next read completes it. addresses keep counting past $FFFF and
+// wrap at 32 bits. returns the number of bytes read
+long long disasm_stream(FILE *file, int base_address, bool cycles, output_buffer *out, long long *instructions)
+{
+    unsigned char *buffer = (unsigned char *)malloc(STREAM_BUFFER_SIZE);
+    long long position = 0; // input offset of buffer[0]
+    int carry = 0;
+    *instructions = 0;
+
+    output_text(out, "Address  Hexdump   Dissassembly\n");
+    output_text(out, "-------------------------------\n");
+    for (;;)
+    {
+        int size = carry + (int)fread(buffer + carry, 1, STREAM_BUFFER_SIZE - carry, file);
+        bool last = feof(file) || ferror(file);
+        int chunk_base = (int)(unsigned int)(base_address + position);
+        int offset = 0;
+        while ((offset < size) && (last || (offset + opcodes[buffer[offset]].length <= size)))
         {
-            pos++;
+            offset += cycles ? disasm_single_cycles(buffer, offset, size, chunk_base, out) : disasm_single(buffer, offset, size, chunk_base, out);
+            (*instructions)++;
+        }
+        position += offset;
+        if (last)
+        {
+            break;
         }
+        carry = size - offset;
+        memmove(buffer, buffer + offset, carry);
     }
 
-    return length;
+    free(buffer);
+    return position;
 }
 
-int translate_instruction(const char *op, address_mode mode, int current_address, int parsed_address, unsigned char *out)
+// reverse lookup: mnemonic x address mode -> opcode byte (-1 if invalid)
+// mnemonics are 3 letters, so they can be packed as 5 bits per letter into a 15-bit key
+
+#define MAX_MNEMONICS 64
+
+// mnemonic key -> mnemonic id, open addressing with linear probing
+
+#define MNEMONIC_SLOTS 128
+
+struct encoder_table
+{
+    int keys[MNEMONIC_SLOTS]; // 0 = empty slot
+    unsigned char ids[MNEMONIC_SLOTS];
+    short modes[MAX_MNEMONICS][address_mode_count];
+    short zero_page[256]; // zero page variant of an absolute opcode, -1 if there is none
+    int mnemonic_count;
+};
+
+constexpr int mnemonic_key(const char *op, int length)
 {
-    for (int pass = 0; pass < 2; pass++)
+    if (length != 3)
+    {
+        return -1;
+    }
+    int key = 0;
+    for (int i = 0; i < 3; i++)
     {
-        for (int id = 0; id < 256; id++)
+        char c = op[i] & ~0x20; // upper case
+        if ((c < 'A') || (c > 'Z'))
         {
-            if (_stricmp(opcodes[id].mnemonic, op) == 0)
-            {
-                address_mode test_mode = mode;
-                // special case: branch instructions have relative addressing
-                if ((opcodes[id].mode == address_mode_rel) && (mode == address_mode_abs))
-                {
-                    test_mode = address_mode_rel;
-                    parsed_address = parsed_address - current_address - 2;
-                }
-                else if ((opcodes[id].mode == address_mode_acc) && (mode == address_mode_imp))
-                {
-                    test_mode = address_mode_acc;
-                }
-                else if ((pass == 0) && (parsed_address <= 0xFF))
-                {
-                    // check for zp addressing only on first pass
-                    if (mode == address_mode_abs)
-                    {
-                        test_mode = address_mode_zp;
-                    }
-                    else if (mode == address_mode_abs_x)
-                    {
-                        test_mode = address_mode_zp_x;
-                    }
-                    else if (mode == address_mode_abs_y)
-                    {
-                        test_mode = address_mode_zp_y;
-                    }
-                }
-                if (opcodes[id].mode == test_mode)
-                {
-                    out[0] = id;
-                    if (opcodes[id].length == 2)
-                    {
-                        out[1] = parsed_address & 0xFF;
-                    }
-                    else if (opcodes[id].length == 3)
-                    {
-                        out[1] = parsed_address & 0xFF;
-                        out[2] = (parsed_address >> 8) & 0xFF;
-                    }
-                    return opcodes[id].length;
-                }
-            }
+            return -1;
         }
+        key = (key << 5) | (c - 'A' + 1);
     }
-    assert(!"invalid op/mode");
+    return key;
 }
 
-int translate_program(const char *program, unsigned char *bytes, int size, int base_address)
+constexpr int mnemonic_slot(int key)
 {
-    // do 2 passes:
-    // 1) index labels
-    // 2) actually do translation
-    int offset = 0;
-    for (int pass = 0; pass < 2; pass++)
+    return (int)(((unsigned)key * 40503u) >> 8) & (MNEMONIC_SLOTS - 1);
+}
+
+constexpr encoder_table build_encoder()
+{
+    encoder_table table = {};
+    for (int m = 0; m < MAX_MNEMONICS; m++)
     {
-        const char *c = program;
-        const char *end = program + size - 1;
-        const char *line = c;
-        parsed_line parsed;
-        int length = 0;
-        offset = base_address;
-        while (c <= end)
+        for (int mode = 0; mode < address_mode_count; mode++)
         {
-            if ((*c == '\n') || (*c == '\r') || (*c == 0) || (c == end))
-            {
-                if (length > 0)
-                {
-                    parse_line(line, length, &parsed);
-                    if (strlen(parsed.label) > 0)
-                    {
-                        if (pass == 0)
-                        {
-                            labels = add_symbol(labels, parsed.label, offset);
-                        }
-                    }
-                    if (_stricmp(parsed.op, "DEFINE") == 0)
-                    {
-                        if (pass == 0)
-                        {
-                            // special case, split symbol and value
-                            int pos = 0;
-                            int len = strlen(parsed.args);
-                            for (int i = 0; i < len; i++)
-                            {
-                                if ((parsed.args[i] == ' ') || (parsed.args[i] == '\t'))
-                                {
-                                    pos = i;
-                                    break;
-                                }
-                            }
-                            parsed.args[pos] = 0;
-                            pos++;
-                            while ((parsed.args[pos] == ' ') || (parsed.args[pos] == '\t'))
-                            {
-                                pos++;
-                            }
-                            int value = parse_value(parsed.args + pos);
-                            defines = add_symbol(defines, parsed.args, value);
-                        }
-                    }
-                    else if (parsed.op[0])
+            table.modes[m][mode] = -1;
+        }
+    }
+
+    for (int i = 0; i < OPCODE_DEF_COUNT; i++)
+    {
+        int key = mnemonic_key(opcode_defs[i].mnemonic, 3);
+        int slot = mnemonic_slot(key);
+        while ((table.keys[slot] != 0) && (table.keys[slot] != key))
+        {
+            slot = (slot + 1) & (MNEMONIC_SLOTS - 1);
+        }
+        if (table.keys[slot] == 0)
+        {
+            table.keys[slot] = key;
+            table.ids[slot] = (unsigned char)table.mnemonic_count++;
+        }
+        table.modes[table.ids[slot]][opcode_defs[i].mode] = (short)opcode_defs[i].id;
+    }
+
+    for (int id = 0; id < 256; id++)
+    {
+        table.zero_page[id] = -1;
+    }
+    for (int m = 0; m < table.mnemonic_count; m++)
+    {
+        const short *modes = table.modes[m];
+        if (modes[address_mode_abs] >= 0)
+        {
+            table.zero_page[modes[address_mode_abs]] = modes[address_mode_zp];
+        }
+        if (modes[address_mode_abs_x] >= 0)
+        {
+            table.zero_page[modes[address_mode_abs_x]] = modes[address_mode_zp_x];
+        }
+        if (modes[address_mode_abs_y] >= 0)
+        {
+            table.zero_page[modes[address_mode_abs_y]] = modes[address_mode_zp_y];
+        }
+    }
+    return table;
+}
+
+constexpr encoder_table encoder_data = build_encoder();
+constexpr const short (&encoder)[MAX_MNEMONICS][address_mode_count] = encoder_data.modes;
+
+static_assert(encoder_data.mnemonic_count <= MAX_MNEMONICS, "too many mnemonics for the encoder table");
+static_assert(encoder_data.mnemonic_count * 2 <= MNEMONIC_SLOTS, "mnemonic hash too full");
+
+// probes, if not 0, counts the hash slots looked at for --stats
+inline int mnemonic_id(const char *op, int length, int *probes)
+{
+    int key = mnemonic_key(op, length);
+    if (key < 0)
+    {
+        return -1;
+    }
+    int slot = mnemonic_slot(key);
+    while (encoder_data.keys[slot] != 0)
+    {
+        if (probes)
+        {
+            (*probes)++;
+        }
+        if (encoder_data.keys[slot] == key)
+        {
+            return encoder_data.ids[slot];
+        }
+        slot = (slot + 1) & (MNEMONIC_SLOTS - 1);
+    }
+    return -1;
+}
+
+// 6502 interpreter: runs the assembled image in place, in a flat 64K memory
+// one handler per opcode byte, each instantiated from the opcode definitions above, so
+// the address mode and the operation are resolved at compile time
+
+struct cpu;
+
+typedef unsigned char (*io_read_hook)(cpu *c, int address);
+typedef void (*io_write_hook)(cpu *c, int address, unsigned char value);
+
+enum cpu_stop
+{
+    cpu_running,
+    cpu_stop_brk,
+    cpu_stop_illegal,
+    cpu_stop_limit,
+};
+
+struct cpu
+{
+    unsigned char *memory; // 64K
+    int pc;
+    unsigned char a, x, y, sp;
+    unsigned char flag_c, flag_v, flag_d, flag_i; // 0 or 1
+    unsigned char z_value;  // Z is set when z_value == 0
+    unsigned char n_value;  // N is bit 7 of n_value
+
+    // memory-mapped I/O: data reads and writes in [io_start, io_start + io_size) go through
+    // the hooks, instruction fetches, zero page pointers and the stack always use memory
+    int io_start;
+    int io_size;
+    io_read_hook io_read;
+    io_write_hook io_write;
+    void *io_context;
+
+    bool brk_halts; // BRK ends the program instead of jumping through $FFFE
+    cpu_stop stop;
+    long long instructions;
+};
+
+void cpu_reset(cpu *c, unsigned char *memory, int pc)
+{
+    *c = {};
+    c->memory = memory;
+    c->pc = pc & 0xFFFF;
+    c->sp = 0xFF;
+    c->z_value = 1;
+    c->brk_halts = true;
+}
+
+inline unsigned char cpu_read(cpu *c, int address)
+{
+    if (((unsigned)(address - c->io_start) < (unsigned)c->io_size) && c->io_read)
+    {
+        return c->io_read(c, address);
+    }
+    return c->memory[address];
+}
+
+inline void cpu_write(cpu *c, int address, unsigned char value)
+{
+    if (((unsigned)(address - c->io_start) < (unsigned)c->io_size) && c->io_write)
+    {
+        c->io_write(c, address, value);
+        return;
+    }
+    c->memory[address] = value;
+}
+
+inline void cpu_push(cpu *c, unsigned char value)
+{
+    c->memory[0x100 + c->sp--] = value;
+}
+
+inline unsigned char cpu_pull(cpu *c)
+{
+    return c->memory[0x100 + ++c->sp];
+}
+
+inline void cpu_set_nz(cpu *c, unsigned char value)
+{
+    c->z_value = value;
+    c->n_value = value;
+}
+
+inline unsigned char cpu_status(cpu *c, int brk)
+{
+    return (c->n_value & 0x80) | (c->flag_v << 6) | 0x20 | (brk ? 0x10 : 0) | (c->flag_d << 3) | (c->flag_i << 2) | ((c->z_value == 0) << 1) | c->flag_c;
+}
+
+inline void cpu_set_status(cpu *c, unsigned char p)
+{
+    c->n_value = p & 0x80;
+    c->flag_v = (p >> 6) & 1;
+    c->flag_d = (p >> 3) & 1;
+    c->flag_i = (p >> 2) & 1;
+    c->z_value = (p & 0x02) ? 0 : 1;
+    c->flag_c = p & 1;
+}
+
+// effective address, pc points at the operand (immediate operands are read in place)
+template <address_mode mode>
+inline int cpu_address(cpu *c)
+{
+    const unsigned char *m = c->memory;
+    int pc = c->pc;
+    int lo, base;
+    switch (mode)
+    {
+        case address_mode_imm:
+        case address_mode_rel:
+            return pc;
+        case address_mode_zp:
+            return m[pc];
+        case address_mode_zp_x:
+            return (m[pc] + c->x) & 0xFF;
+        case address_mode_zp_y:
+            return (m[pc] + c->y) & 0xFF;
+        case address_mode_abs:
+            return m[pc] | (m[(pc + 1) & 0xFFFF] << 8);
+        case address_mode_abs_x:
+            return ((m[pc] | (m[(pc + 1) & 0xFFFF] << 8)) + c->x) & 0xFFFF;
+        case address_mode_abs_y:
+            return ((m[pc] | (m[(pc + 1) & 0xFFFF] << 8)) + c->y) & 0xFFFF;
+        case address_mode_ind:
+            // the high byte does not carry into the next page, as on the NMOS 6502
+            lo = m[pc] | (m[(pc + 1) & 0xFFFF] << 8);
+            return m[lo] | (m[(lo & 0xFF00) | ((lo + 1) & 0xFF)] << 8);
+        case address_mode_ind_x:
+            base = (m[pc] + c->x) & 0xFF;
+            return m[base] | (m[(base + 1) & 0xFF] << 8);
+        case address_mode_ind_y:
+            base = m[pc];
+            return ((m[base] | (m[(base + 1) & 0xFF] << 8)) + c->y) & 0xFFFF;
+        default:
+            return 0;
+    }
+}
+
+inline void cpu_adc(cpu *c, unsigned char value)
+{
+    int sum = c->a + value + c->flag_c;
+    if (!c->flag_d)
+    {
+        c->flag_v = (~(c->a ^ value) & (c->a ^ sum) & 0x80) != 0;
+        c->flag_c = sum > 0xFF;
+        c->a = (unsigned char)sum;
+        cpu_set_nz(c, c->a);
+        return;
+    }
+
+    // decimal mode, Z from the binary sum and N/V from the intermediate result
+    int lo = (c->a & 0x0F) + (value & 0x0F) + c->flag_c;
+    if (lo > 9)
+    {
+        lo += 6;
+    }
+    int hi = (c->a >> 4) + (value >> 4) + (lo > 0x0F);
+    c->z_value = (unsigned char)sum;
+    c->n_value = (unsigned char)(hi << 4);
+    c->flag_v = (~(c->a ^ value) & (c->a ^ (hi << 4)) & 0x80) != 0;
+    if (hi > 9)
+    {
+        hi += 6;
+    }
+    c->flag_c = hi > 0x0F;
+    c->a = (unsigned char)((hi << 4) | (lo & 0x0F));
+}
+
+inline void cpu_sbc(cpu *c, unsigned char value)
+{
+    if (!c->flag_d)
+    {
+        cpu_adc(c, value ^ 0xFF);
+        return;
+    }
+
+    // decimal mode, flags from the binary difference
+    int borrow = 1 - c->flag_c;
+    int diff = c->a - value - borrow;
+    int lo = (c->a & 0x0F) - (value & 0x0F) - borrow;
+    int hi = (c->a >> 4) - (value >> 4);
+    if (lo & 0x10)
+    {
+        lo -= 6;
+        hi--;
+    }
+    if (hi & 0x10)
+    {
+        hi -= 6;
+    }
+    c->flag_v = ((c->a ^ value) & (c->a ^ diff) & 0x80) != 0;
+    c->flag_c = (unsigned)diff < 0x100;
+    cpu_set_nz(c, (unsigned char)diff);
+    c->a = (unsigned char)((hi << 4) | (lo & 0x0F));
+}
+
+inline void cpu_compare(cpu *c, unsigned char reg, unsigned char value)
+{
+    c->flag_c = reg >= value;
+    cpu_set_nz(c, (unsigned char)(reg - value));
+}
+
+inline void cpu_branch(cpu *c, bool taken, int address)
+{
+    if (taken)
+    {
+        c->pc = (c->pc + (signed char)c->memory[address]) & 0xFFFF;
+    }
+}
+
+template <int id>
+void cpu_execute(cpu *c)
+{
+    constexpr address_mode mode = opcodes[id].mode;
+    int address = cpu_address<mode>(c);
+    c->pc = (c->pc + opcodes[id].length - 1) & 0xFFFF;
+
+    // read-modify-write operand: the accumulator or memory
+#define _load() ((mode == address_mode_acc) ? c->a : cpu_read(c, address))
+#define _store(value) if (mode == address_mode_acc) { c->a = (value); } else { cpu_write(c, address, (value)); }
+#define _op(mnemonic) mnemonic_key(mnemonic, 3)
+
+    unsigned char value;
+    int result;
+    switch (mnemonic_key(opcodes[id].mnemonic, 3))
+    {
+        case _op("LDA"): c->a = cpu_read(c, address); cpu_set_nz(c, c->a); break;
+        case _op("LDX"): c->x = cpu_read(c, address); cpu_set_nz(c, c->x); break;
+        case _op("LDY"): c->y = cpu_read(c, address); cpu_set_nz(c, c->y); break;
+        case _op("STA"): cpu_write(c, address, c->a); break;
+        case _op("STX"): cpu_write(c, address, c->x); break;
+        case _op("STY"): cpu_write(c, address, c->y); break;
+
+        case _op("ADC"): cpu_adc(c, cpu_read(c, address)); break;
+        case _op("SBC"): cpu_sbc(c, cpu_read(c, address)); break;
+        case _op("AND"): c->a &= cpu_read(c, address); cpu_set_nz(c, c->a); break;
+        case _op("ORA"): c->a |= cpu_read(c, address); cpu_set_nz(c, c->a); break;
+        case _op("EOR"): c->a ^= cpu_read(c, address); cpu_set_nz(c, c->a); break;
+        case _op("CMP"): cpu_compare(c, c->a, cpu_read(c, address)); break;
+        case _op("CPX"): cpu_compare(c, c->x, cpu_read(c, address)); break;
+        case _op("CPY"): cpu_compare(c, c->y, cpu_read(c, address)); break;
+        case _op("BIT"):
+            value = cpu_read(c, address);
+            c->z_value = c->a & value;
+            c->n_value = value;
+            c->flag_v = (value >> 6) & 1;
+            break;
+
+        case _op("INC"): value = cpu_read(c, address) + 1; cpu_write(c, address, value); cpu_set_nz(c, value); break;
+        case _op("DEC"): value = cpu_read(c, address) - 1; cpu_write(c, address, value); cpu_set_nz(c, value); break;
+        case _op("INX"): cpu_set_nz(c, ++c->x); break;
+        case _op("INY"): cpu_set_nz(c, ++c->y); break;
+        case _op("DEX"): cpu_set_nz(c, --c->x); break;
+        case _op("DEY"): cpu_set_nz(c, --c->y); break;
+
+        case _op("ASL"):
+            value = _load();
+            c->flag_c = value >> 7;
+            value <<= 1;
+            _store(value);
+            cpu_set_nz(c, value);
+            break;
+        case _op("LSR"):
+            value = _load();
+            c->flag_c = value & 1;
+            value >>= 1;
+            _store(value);
+            cpu_set_nz(c, value);
+            break;
+        case _op("ROL"):
+            result = (_load() << 1) | c->flag_c;
+            c->flag_c = (result >> 8) & 1;
+            value = (unsigned char)result;
+            _store(value);
+            cpu_set_nz(c, value);
+            break;
+        case _op("ROR"):
+            value = _load();
+            result = (value >> 1) | (c->flag_c << 7);
+            c->flag_c = value & 1;
+            value = (unsigned char)result;
+            _store(value);
+            cpu_set_nz(c, value);
+            break;
+
+        case _op("BPL"): cpu_branch(c, !(c->n_value & 0x80), address); break;
+        case _op("BMI"): cpu_branch(c, (c->n_value & 0x80) != 0, address); break;
+        case _op("BVC"): cpu_branch(c, !c->flag_v, address); break;
+        case _op("BVS"): cpu_branch(c, c->flag_v != 0, address); break;
+        case _op("BCC"): cpu_branch(c, !c->flag_c, address); break;
+        case _op("BCS"): cpu_branch(c, c->flag_c != 0, address); break;
+        case _op("BNE"): cpu_branch(c, c->z_value != 0, address); break;
+        case _op("BEQ"): cpu_branch(c, c->z_value == 0, address); break;
+
+        case _op("JMP"): c->pc = address; break;
+        case _op("JSR"):
+            result = (c->pc - 1) & 0xFFFF;
+            cpu_push(c, (unsigned char)(result >> 8));
+            cpu_push(c, (unsigned char)result);
+            c->pc = address;
+            break;
+        case _op("RTS"):
+            result = cpu_pull(c);
+            result |= cpu_pull(c) << 8;
+            c->pc = (result + 1) & 0xFFFF;
+            break;
+        case _op("RTI"):
+            cpu_set_status(c, cpu_pull(c));
+            result = cpu_pull(c);
+            result |= cpu_pull(c) << 8;
+            c->pc = result;
+            break;
+        case _op("BRK"):
+            if (c->brk_halts)
+            {
+                c->pc = (c->pc - 1) & 0xFFFF;
+                c->stop = cpu_stop_brk;
+                break;
+            }
+            result = (c->pc + 1) & 0xFFFF; // BRK skips a padding byte
+            cpu_push(c, (unsigned char)(result >> 8));
+            cpu_push(c, (unsigned char)result);
+            cpu_push(c, cpu_status(c, 1));
+            c->flag_i = 1;
+            c->pc = c->memory[0xFFFE] | (c->memory[0xFFFF] << 8);
+            break;
+
+        case _op("CLC"): c->flag_c = 0; break;
+        case _op("SEC"): c->flag_c = 1; break;
+        case _op("CLI"): c->flag_i = 0; break;
+        case _op("SEI"): c->flag_i = 1; break;
+        case _op("CLV"): c->flag_v = 0; break;
+        case _op("CLD"): c->flag_d = 0; break;
+        case _op("SED"): c->flag_d = 1; break;
+
+        case _op("TAX"): c->x = c->a; cpu_set_nz(c, c->x); break;
+        case _op("TXA"): c->a = c->x; cpu_set_nz(c, c->a); break;
+        case _op("TAY"): c->y = c->a; cpu_set_nz(c, c->y); break;
+        case _op("TYA"): c->a = c->y; cpu_set_nz(c, c->a); break;
+        case _op("TSX"): c->x = c->sp; cpu_set_nz(c, c->x); break;
+        case _op("TXS"): c->sp = c->x; break;
+        case _op("PHA"): cpu_push(c, c->a); break;
+        case _op("PLA"): c->a = cpu_pull(c); cpu_set_nz(c, c->a); break;
+        case _op("PHP"): cpu_push(c, cpu_status(c, 1)); break;
+        case _op("PLP"): cpu_set_status(c, cpu_pull(c)); break;
+
+        case _op("NOP"):
+        case _op("WDM"):
+            break;
+
+        default:
+            // undocumented opcode, pc is left on it
+            c->pc = (c->pc - 1) & 0xFFFF;
+            c->stop = cpu_stop_illegal;
+            break;
+    }
+
+#undef _op
+#undef _store
+#undef _load
+}
+
+typedef void (*cpu_handler)(cpu *c);
+
+struct cpu_handler_table
+{
+    cpu_handler entries[256];
+};
+
+template <int... ids>
+constexpr cpu_handler_table build_cpu_handlers(std::integer_sequence<int, ids...>)
+{
+    return { { &cpu_execute<ids>... } };
+}
+
+constexpr cpu_handler_table cpu_handlers = build_cpu_handlers(std::make_integer_sequence<int, 256>());
+
+// runs until BRK, an undocumented opcode or max_instructions
+cpu_stop cpu_run(cpu *c, long long max_instructions)
+{
+    c->stop = cpu_running;
+    long long count = 0;
+    while (count < max_instructions)
+    {
+        int id = c->memory[c->pc];
+        c->pc = (c->pc + 1) & 0xFFFF;
+        cpu_handlers.entries[id](c);
+        count++;
+        if (c->stop != cpu_running)
+        {
+            break;
+        }
+    }
+    c->instructions += count;
+    if (c->stop == cpu_running)
+    {
+        c->stop = cpu_stop_limit;
+    }
+    return c->stop;
+}
+
+void disasm_test()
+{
+    //unsigned char example[] = { 0xa9, 0xc0, 0xaa, 0xe8, 0x69, 0xc4, 0x00 };
+    //unsigned char example[] = { 0xa9, 0x00, 0x8d, 0x00, 0x02, 0xa9, 0x01, 0x8d, 0x01, 0x02, 0x8d, 0xff, 0x05 };
+    //unsigned char example[] = { 0xa9, 0x80, 0x85, 0x01, 0x65, 0x01, 0xa9, 0xf1, 0xaa, 0xa9, 0xf2, 0xa8, 0xa9, 0x00, 0x98, 0x8a };
+    //unsigned char example[] = { 0xa9, 0x03, 0x85, 0x00, 0xa9, 0x09, 0x38, 0xe5, 0x00, 0x85, 0x01 };
+    //unsigned char example[] = { 0xa2, 0x08, 0xca, 0x8e, 0x00, 0x02, 0xe0, 0x03, 0xf0, 0x03, 0x4c, 0x02, 0x06, 0x8e, 0x01, 0x02 };
+    //unsigned char example[] = { 0xa2, 0x08, 0xca, 0x8e, 0x00, 0x02, 0xe0, 0x03, 0xd0, 0xf8, 0x8e, 0x01, 0x02, 0x00, 0xff };
+    //unsigned char example[] = { 0xa2, 0x02, 0x8e, 0x00, 0x02, 0xa9, 0xf0, 0x6d, 0x00, 0x02, 0x90, 0xfb, 0x8e, 0x01, 0x02, 0x00 };
+    //unsigned char example[] = { 0xa2, 0x00, 0xa0, 0x00, 0x8a, 0x99, 0x00, 0x02, 0x48, 0xe8, 0xc8, 0xc0, 0x10, 0xd0, 0xf5, 0x68, 0x99, 0x00, 0x02, 0xc8, 0xc0, 0x20, 0xd0, 0xf7 };
+    //unsigned char example[] = { 0x20, 0x09, 0x06, 0x20, 0x0c, 0x06, 0x20, 0x12, 0x06, 0xa2, 0x00, 0x60, 0xe8, 0xe0, 0x05, 0xd0, 0xfb, 0x60, 0x00 };
+    //unsigned char example[] = { 0x20, 0x06, 0x06, 0x20, 0x38, 0x06, 0x20, 0x0d, 0x06, 0x20, 0x2a, 0x06, 0x60, 0xa9, 0x02, 0x85, 0x02, 0xa9, 0x04, 0x85, 0x03, 0xa9, 0x11, 0x85, 0x10, 0xa9, 0x10, 0x85, 0x12, 0xa9, 0x0f, 0x85, 0x14, 0xa9, 0x04, 0x85, 0x11, 0x85, 0x13, 0x85, 0x15, 0x60, 0xa5, 0xfe, 0x85, 0x00, 0xa5, 0xfe, 0x29, 0x03, 0x18, 0x69, 0x02, 0x85, 0x01, 0x60, 0x20, 0x4d, 0x06, 0x20, 0x8d, 0x06, 0x20, 0xc3, 0x06, 0x20, 0x19, 0x07, 0x20, 0x20, 0x07, 0x20, 0x2d, 0x07, 0x4c, 0x38, 0x06, 0xa5, 0xff, 0xc9, 0x77, 0xf0, 0x0d, 0xc9, 0x64, 0xf0, 0x14, 0xc9, 0x73, 0xf0, 0x1b, 0xc9, 0x61, 0xf0, 0x22, 0x60, 0xa9, 0x04, 0x24, 0x02, 0xd0, 0x26, 0xa9, 0x01, 0x85, 0x02, 0x60, 0xa9, 0x08, 0x24, 0x02, 0xd0, 0x1b, 0xa9, 0x02, 0x85, 0x02, 0x60, 0xa9, 0x01, 0x24, 0x02, 0xd0, 0x10, 0xa9, 0x04, 0x85, 0x02, 0x60, 0xa9, 0x02, 0x24, 0x02, 0xd0, 0x05, 0xa9, 0x08, 0x85, 0x02, 0x60, 0x60, 0x20, 0x94, 0x06, 0x20, 0xa8, 0x06, 0x60, 0xa5, 0x00, 0xc5, 0x10, 0xd0, 0x0d, 0xa5, 0x01, 0xc5, 0x11, 0xd0, 0x07, 0xe6, 0x03, 0xe6, 0x03, 0x20, 0x2a, 0x06, 0x60, 0xa2, 0x02, 0xb5, 0x10, 0xc5, 0x10, 0xd0, 0x06, 0xb5, 0x11, 0xc5, 0x11, 0xf0, 0x09, 0xe8, 0xe8, 0xe4, 0x03, 0xf0, 0x06, 0x4c, 0xaa, 0x06, 0x4c, 0x35, 0x07, 0x60, 0xa6, 0x03, 0xca, 0x8a, 0xb5, 0x10, 0x95, 0x12, 0xca, 0x10, 0xf9, 0xa5, 0x02, 0x4a, 0xb0, 0x09, 0x4a, 0xb0, 0x19, 0x4a, 0xb0, 0x1f, 0x4a, 0xb0, 0x2f, 0xa5, 0x10, 0x38, 0xe9, 0x20, 0x85, 0x10, 0x90, 0x01, 0x60, 0xc6, 0x11, 0xa9, 0x01, 0xc5, 0x11, 0xf0, 0x28, 0x60, 0xe6, 0x10, 0xa9, 0x1f, 0x24, 0x10, 0xf0, 0x1f, 0x60, 0xa5, 0x10, 0x18, 0x69, 0x20, 0x85, 0x10, 0xb0, 0x01, 0x60, 0xe6, 0x11, 0xa9, 0x06, 0xc5, 0x11, 0xf0, 0x0c, 0x60, 0xc6, 0x10, 0xa5, 0x10, 0x29, 0x1f, 0xc9, 0x1f, 0xf0, 0x01, 0x60, 0x4c, 0x35, 0x07, 0xa0, 0x00, 0xa5, 0xfe, 0x91, 0x00, 0x60, 0xa6, 0x03, 0xa9, 0x00, 0x81, 0x10, 0xa2, 0x00, 0xa9, 0x01, 0x81, 0x10, 0x60, 0xa2, 0x00, 0xea, 0xea, 0xca, 0xd0, 0xfb, 0x60 };
+    unsigned char example[] = { 0x20, 0x06, 0x06, 0x20, 0x37, 0x06, 0x20, 0x0d, 0x06, 0x20, 0x2a, 0x06, 0x60, 0xa9, 0x02, 0x85, 0x02, 0xa9, 0x04, 0x85, 0x03, 0xa9, 0x11, 0x85, 0x10, 0xa9, 0x10, 0x85, 0x12, 0xa9, 0x0f, 0x85, 0x14, 0xa9, 0x04, 0x85, 0x11, 0x85, 0x13, 0x85, 0x15, 0x60, 0xa5, 0xfe, 0x85, 0x00, 0xa5, 0xfe, 0x29, 0x03, 0x18, 0x69, 0x02, 0x85, 0x01, 0x20, 0x57, 0x06, 0x20, 0x43, 0x06, 0x20, 0x4a, 0x06, 0x4c, 0x37, 0x06, 0xa0, 0x00, 0xa5, 0xfe, 0x91, 0x00, 0x60, 0xa6, 0x03, 0xa9, 0x00, 0x81, 0x10, 0xa2, 0x00, 0xa9, 0x01, 0x81, 0x10, 0x60, 0xa6, 0x03, 0xca, 0x8a, 0xb5, 0x10, 0x95, 0x12, 0xca, 0x10, 0xf9, 0xa5, 0x02, 0x4a, 0xb0, 0x09, 0x4a, 0xb0, 0x19, 0x4a, 0xb0, 0x1f, 0x4a, 0xb0, 0x2f, 0xa5, 0x10, 0x38, 0xe9, 0x20, 0x85, 0x10, 0x90, 0x01, 0x60, 0xc6, 0x11, 0xa9, 0x01, 0xc5, 0x11, 0xf0, 0x26, 0x60, 0xe6, 0x10, 0xa9, 0x1f, 0x24, 0x10, 0xf0, 0x1d, 0x60, 0xa5, 0x10, 0x18, 0x69, 0x20, 0x85, 0x10, 0xb0, 0x01, 0x60, 0xe6, 0x11, 0xa9, 0x06, 0xc5, 0x11, 0xf0, 0x0a, 0x60, 0xc6, 0x10, 0xa9, 0x1f, 0x25, 0x10, 0xf0, 0x01, 0x60, 0x4c, 0xab, 0x06 };
+
+    disasm_program(example, sizeof(example), 0x600, stdout);
+}
+
+// reference formatter with one fprintf per field, used by disasm_bench to check the output
+// and to compare speed
+
+int disasm_single_fprintf(unsigned char *bytes, int offset, int size, int base_address, FILE *file)
+{
+    int id = bytes[offset];
+    const char *mnemonic = opcodes[id].mnemonic;
+    address_mode mode = opcodes[id].mode;
+
+    unsigned int address = offset + base_address;
+
+    // special case: instruction truncated by the end of the buffer
+    if (offset + opcodes[id].length > size)
+    {
+        int length = size - offset;
+        fprintf(file, "$%04x    ", address);
+        for (int i = 0; i < 3; i++)
+        {
+            if (i < length)
+            {
+                fprintf(file, "%02x ", bytes[offset + i]);
+            }
+            else
+            {
+                fprintf(file, "   ");
+            }
+        }
+        fprintf(file, " ???\n");
+        return length;
+    }
+
+    unsigned int byte = (opcodes[id].length > 1) ? bytes[offset + 1] : 0;
+    unsigned int word = (opcodes[id].length > 2) ? ((bytes[offset + 2] << 8) | byte) : byte;
+    unsigned int rel = offset + base_address + 2 + (signed char)byte;
+
+    fprintf(file, "$%04x    ", address);
+
+    if (opcodes[id].length == 3)
+    {
+        fprintf(file, "%02x %02x %02x  ", bytes[offset], bytes[offset + 1], bytes[offset + 2]);
+    }
+    else if (opcodes[id].length == 2)
+    {
+        fprintf(file, "%02x %02x     ", bytes[offset], bytes[offset + 1]);
+    }
+    else
+    {
+        fprintf(file, "%02x        ", bytes[offset]);
+    }
+
+    switch (mode)
+    {
+        case address_mode_abs:
+            fprintf(file, "%s $%04x\n", mnemonic, word);
+            break;
+        case address_mode_abs_x:
+            fprintf(file, "%s $%04x,X\n", mnemonic, word);
+            break;
+        case address_mode_abs_y:
+            fprintf(file, "%s $%04x,Y\n", mnemonic, word);
+            break;
+        case address_mode_imp:
+            fprintf(file, "%s\n", mnemonic);
+            break;
+        case address_mode_acc:
+            fprintf(file, "%s A\n", mnemonic);
+            break;
+        case address_mode_imm:
+            fprintf(file, "%s #$%02x\n", mnemonic, byte);
+            break;
+        case address_mode_ind:
+            fprintf(file, "%s ($%04x)\n", mnemonic, word);
+            break;
+        case address_mode_ind_x:
+            fprintf(file, "%s ($%02x,X)\n", mnemonic, byte);
+            break;
+        case address_mode_ind_y:
+            fprintf(file, "%s ($%02x),Y\n", mnemonic, byte);
+            break;
+        case address_mode_rel:
+            fprintf(file, "%s $%04x\n", mnemonic, rel);
+            break;
+        case address_mode_zp:
+            fprintf(file, "%s $%02x\n", mnemonic, byte);
+            break;
+        case address_mode_zp_x:
+            fprintf(file, "%s $%02x,X\n", mnemonic, byte);
+            break;
+        case address_mode_zp_y:
+            fprintf(file, "%s $%02x,Y\n", mnemonic, byte);
+            break;
+        default:
+            assert(!"invalid code path");
+            break;
+    }
+
+    return opcodes[id].length;
+}
+
+void disasm_program_fprintf(unsigned char *bytes, int size, int base_address, FILE *file)
+{
+    fprintf(file, "Address  Hexdump   Dissassembly\n");
+    fprintf(file, "-------------------------------\n");
+    for (int offset = 0; offset < size; )
+    {
+        offset += disasm_single_fprintf(bytes, offset, size, base_address, file);
+    }
+}
+
+double get_seconds()
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+bool same_file_contents(FILE *a, FILE *b)
+{
+    char buffer_a[4096], buffer_b[4096];
+    rewind(a);
+    rewind(b);
+    for (;;)
+    {
+        size_t na = fread(buffer_a, 1, sizeof(buffer_a), a);
+        size_t nb = fread(buffer_b, 1, sizeof(buffer_b), b);
+        if ((na != nb) || (memcmp(buffer_a, buffer_b, na) != 0))
+        {
+            return false;
+        }
+        if (na == 0)
+        {
+            return true;
+        }
+    }
+}
+
+void disasm_bench()
+{
+    int size = 4 * 1024 * 1024;
+    unsigned char *bytes = (unsigned char *)malloc(size);
+    unsigned int seed = 12345;
+    for (int i = 0; i < size; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        bytes[i] = (seed >> 16) & 0xFF;
+    }
+
+    int lines = 0;
+    for (int offset = 0; offset < size; lines++)
+    {
+        offset += opcodes[bytes[offset]].length;
+    }
+
+    FILE *f_ref = tmpfile();
+    FILE *f_new = tmpfile();
+    if (!f_ref || !f_new)
+    {
+        printf("Error creating temporary files\n");
+        return;
+    }
+
+    double t0 = get_seconds();
+    disasm_program_fprintf(bytes, size, 0x600, f_ref);
+    fflush(f_ref);
+    double t1 = get_seconds();
+    disasm_program(bytes, size, 0x600, f_new);
+    fflush(f_new);
+    double t2 = get_seconds();
+
+    printf("disasm %d bytes, %d lines\n", size, lines);
+    printf("  fprintf:   %8.3f s  %12.0f lines/s\n", t1 - t0, lines / (t1 - t0));
+    printf("  buffered:  %8.3f s  %12.0f lines/s\n", t2 - t1, lines / (t2 - t1));
+    printf("  output:    %s\n", same_file_contents(f_ref, f_new) ? "identical" : "DIFFERENT");
+
+    int max_threads = (int)std::thread::hardware_concurrency();
+    for (int threads = 2; threads <= ((max_threads > 4) ? max_threads : 4); threads *= 2)
+    {
+        FILE *f_par = tmpfile();
+        if (!f_par)
+        {
+            break;
+        }
+        double t3 = get_seconds();
+        output_buffer out;
+        output_init(&out, f_par, OUTPUT_BUFFER_SIZE);
+        disasm_program_parallel(bytes, size, 0x600, &out, threads);
+        output_free(&out);
+        fflush(f_par);
+        double t4 = get_seconds();
+        printf("  %2d threads: %7.3f s  %12.0f lines/s  %s\n", threads, t4 - t3, lines / (t4 - t3),
+            same_file_contents(f_ref, f_par) ? "identical" : "DIFFERENT");
+        fclose(f_par);
+    }
+
+    fclose(f_ref);
+    fclose(f_new);
+    free(bytes);
+}
+
+// (pointer, length) view into the source text, not NUL terminated
+struct text_view
+{
+    const char *text;
+    int length;
+};
+
+inline bool view_equals(text_view view, const char *text)
+{
+    int length = (int)strlen(text);
+    return (view.length == length) && (_strnicmp(view.text, text, length) == 0);
+}
+
+inline bool is_ident_char(char c)
+{
+    return (c == '_') || ((c >= 'A') && (c <= 'Z')) || ((c >= 'a') && (c <= 'z')) || ((c >= '0') && (c <= '9'));
+}
+
+struct parsed_line
+{
+    text_view label;
+    text_view op;
+    text_view args;
+};
+
+void parse_line(const char *line, int length, parsed_line *parsed)
+{
+    int start, end, pos = 0;
+
+#define _ch(i) (((i) < length) ? line[i] : 0)
+
+    parsed->label = { line, 0 };
+    parsed->op = { line, 0 };
+
+    while ((_ch(pos) == ' ') || (_ch(pos) == '\t'))
+    {
+        pos++;
+    }
+
+    // special case - set address *=$12AB
+    if ((_ch(pos) == '*') && (_ch(pos + 1) == '='))
+    {
+        parsed->op = { &line[pos], 1 };
+        pos += 2;
+        start = pos;
+
+        while ((_ch(pos) != ';') && (_ch(pos) != '\n') && (_ch(pos) != '\r') && (_ch(pos) != 0))
+        {
+            pos++;
+        }
+        end = pos;
+
+        parsed->args = { &line[start], end - start };
+        return;
+    }
+
+    start = pos;
+    while (is_ident_char(_ch(pos)))
+    {
+        pos++;
+    }
+    end = pos;
+
+    while ((_ch(pos) == ' ') || (_ch(pos) == '\t'))
+    {
+        pos++;
+    }
+
+    if (_ch(pos) != ':')
+    {
+        parsed->op = { &line[start], end - start };
+    }
+    else
+    {
+        parsed->label = { &line[start], end - start };
+        pos++;
+
+        while ((_ch(pos) == ' ') || (_ch(pos) == '\t'))
+        {
+            pos++;
+        }
+
+        start = pos;
+        while (is_ident_char(_ch(pos)))
+        {
+            pos++;
+        }
+        end = pos;
+        parsed->op = { &line[start], end - start };
+    }
+
+    while ((_ch(pos) == ' ') || (_ch(pos) == '\t'))
+    {
+        pos++;
+    }
+
+    start = pos;
+    while ((_ch(pos) != ';') && (_ch(pos) != '\n') && (_ch(pos) != '\r') && (_ch(pos) != 0))
+    {
+        pos++;
+    }
+    end = pos;
+
+    parsed->args = { &line[start], end - start };
+
+#undef _ch
+}
+
+// bump allocator owning everything allocated for one assembly (symbols, names, fixups)
+// blocks are kept on reset and reused, so resetting between files is O(1)
+
+struct arena_block
+{
+    arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+struct arena
+{
+    arena_block *first;
+    arena_block *current;
+};
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_HEADER_SIZE ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+inline unsigned char *arena_block_data(arena_block *block)
+{
+    return (unsigned char *)block + ARENA_HEADER_SIZE;
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    arena_block *block = a->current;
+    if (block && (block->used + size > block->size))
+    {
+        // move on to the next kept block if it fits, otherwise insert a new one
+        block = block->next;
+        if (block && (size <= block->size))
+        {
+            block->used = 0;
+        }
+        else
+        {
+            block = 0;
+        }
+    }
+
+    if (!block)
+    {
+        size_t block_size = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        block = (arena_block *)malloc(ARENA_HEADER_SIZE + block_size);
+        block->size = block_size;
+        block->used = 0;
+        if (a->current)
+        {
+            block->next = a->current->next;
+            a->current->next = block;
+        }
+        else
+        {
+            block->next = a->first;
+            a->first = block;
+        }
+    }
+
+    a->current = block;
+    void *ptr = arena_block_data(block) + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void *arena_alloc_zero(arena *a, size_t size)
+{
+    void *ptr = arena_alloc(a, size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+char *arena_strndup(arena *a, const char *text, int length)
+{
+    char *copy = (char *)arena_alloc(a, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = 0;
+    return copy;
+}
+
+void arena_reset(arena *a)
+{
+    a->current = a->first;
+    if (a->first)
+    {
+        a->first->used = 0;
+    }
+}
+
+void arena_free(arena *a)
+{
+    for (arena_block *block = a->first, *next = 0; block; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+    *a = {};
+}
+
+// symbol tables are case-insensitive hash tables with open addressing (linear probing)
+
+struct symbol
+{
+    char *label; // 0 = empty slot
+    int length;
+    unsigned int hash;
+    int offset;
+    int pass; // layout pass that last defined it
+};
+
+struct symbol_table
+{
+    symbol *slots;
+    int capacity; // always a power of 2
+    int count;
+
+    // probe statistics
+    int lookups;
+    int probes;
+    int max_probes;
+
+    arena *memory; // owns slots and names
+};
+
+// label values are bank << 16 | CPU address, so the marker is above any bank
+#define INVALID_ADDRESS 0x7FFFFFFF
+
+// a label value without its bank
+inline int cpu_address(int value)
+{
+    return (value > 0xFFFF) && (value != INVALID_ADDRESS) ? (value & 0xFFFF) : value;
+}
+
+unsigned int hash_symbol(const char *text, int length)
+{
+    // FNV-1a over upper case characters
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)(text[i] & ~0x20)) * 16777619u;
+    }
+    return hash;
+}
+
+// returns the slot holding text, or the empty slot where it should be inserted
+symbol *find_slot(symbol_table *table, const char *text, int length, unsigned int hash)
+{
+    int mask = table->capacity - 1;
+    int probes = 1;
+    symbol *s;
+    for (int i = hash & mask; ; i = (i + 1) & mask, probes++)
+    {
+        s = &table->slots[i];
+        if (!s->label || ((s->hash == hash) && (s->length == length) && (_strnicmp(text, s->label, length) == 0)))
+        {
+            break;
+        }
+    }
+    table->lookups++;
+    table->probes += probes;
+    if (probes > table->max_probes)
+    {
+        table->max_probes = probes;
+    }
+    return s;
+}
+
+void grow_symbols(symbol_table *table)
+{
+    symbol *old_slots = table->slots;
+    int old_capacity = table->capacity;
+
+    table->capacity = old_capacity ? old_capacity * 2 : 64;
+    table->slots = (symbol *)arena_alloc_zero(table->memory, table->capacity * sizeof(symbol));
+
+    int mask = table->capacity - 1;
+    for (int i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i].label)
+        {
+            int j = old_slots[i].hash & mask;
+            while (table->slots[j].label)
+            {
+                j = (j + 1) & mask;
+            }
+            table->slots[j] = old_slots[i];
+        }
+    }
+}
+
+// returns the existing symbol, or a new one with an invalid offset
+symbol *insert_symbol(symbol_table *table, const char *text, int length, bool *existed)
+{
+    // keep load factor <= 1/2
+    if ((table->count + 1) * 2 > table->capacity)
+    {
+        grow_symbols(table);
+    }
+
+    unsigned int hash = hash_symbol(text, length);
+    symbol *s = find_slot(table, text, length, hash);
+    *existed = (s->label != 0);
+    if (!s->label)
+    {
+        s->label = arena_strndup(table->memory, text, length);
+        s->length = length;
+        s->hash = hash;
+        s->offset = INVALID_ADDRESS;
+        s->pass = -1;
+        table->count++;
+    }
+    return s;
+}
+
+// returns false if the symbol is already defined
+bool add_symbol(symbol_table *table, const char *text, int length, int offset)
+{
+    bool existed;
+    symbol *s = insert_symbol(table, text, length, &existed);
+    if (existed)
+    {
+        return false;
+    }
+    s->offset = offset;
+    return true;
+}
+
+symbol *find_symbol(symbol_table *table, const char *text, int length)
+{
+    if (table->count == 0)
+    {
+        return 0;
+    }
+    symbol *s = find_slot(table, text, length, hash_symbol(text, length));
+    return s->label ? s : 0;
+}
+
+int lookup_symbol(symbol_table *table, const char *text, int length)
+{
+    symbol *s = find_symbol(table, text, length);
+    return s ? s->offset : INVALID_ADDRESS;
+}
+
+// the memory itself is owned by the arena
+void free_symbols(symbol_table *table)
+{
+    arena *memory = table->memory;
+    *table = {};
+    table->memory = memory;
+}
+
+// operand expressions, compiled to postfix; symbol names are kept as offsets into the
+// expression text, so a compiled expression is only valid together with that text
+
+enum expr_kind
+{
+    expr_const,
+    expr_symbol,
+    expr_pc, // *, the address of the current instruction
+    // unary
+    expr_neg,
+    expr_lo,
+    expr_hi,
+    expr_bank,
+    // binary
+    expr_mul,
+    expr_div,
+    expr_add,
+    expr_sub,
+    expr_shl,
+    expr_shr,
+    expr_and,
+    expr_xor,
+    expr_or,
+};
+
+struct expr_op
+{
+    int kind;
+    int value;  // expr_const: the value, expr_symbol: offset of the name in the text
+    int length; // expr_symbol: length of the name
+};
+
+#define EXPR_MAX_OPS 32
+
+struct expr
+{
+    const char *text;
+    int count;
+    expr_op ops[EXPR_MAX_OPS];
+};
+
+enum fixup_kind
+{
+    fixup_byte,
+    fixup_word,
+    fixup_rel,
+    fixup_data,   // DCB byte
+    fixup_define, // DEFINE waiting for the symbols of its value
+};
+
+struct fixup
+{
+    int address; // address of the instruction or DCB byte, current address for fixup_define
+    int image;   // where its bytes are in the output image
+    fixup_kind kind;
+    int next; // next fixup for the same symbol, -1 = end of chain
+
+    // the deferred expression, ops are owned by the arena
+    const char *text;
+    expr_op *ops;
+    int count;
+
+    text_view name; // fixup_define: the constant being defined
+};
+
+// all the state of one assembly, so independent files can be assembled concurrently
+
+// --stats: phase timings and counters for one job
+// the assembler only holds a pointer, null unless --stats is given, so when disabled
+// every counter costs a single predictable test
+
+struct asm_stats
+{
+    double load_seconds;
+    double translate_seconds;   // the translation pass, fixups included
+    double unresolved_seconds;  // final check for undefined symbols
+    double listing_seconds;
+    double execute_seconds;     // -x
+    int passes;
+    long long lines;            // lines tokenized, this and the counts up to fixups are for the last pass
+    long long instructions;
+    long long opcode_probes;    // mnemonic hash slots looked at by translate_instruction
+    long long symbol_hits;
+    long long symbol_misses;
+    long long bytes_emitted;    // instructions and DCB data
+    long long dcb_bytes;
+    long long fixups;
+    long long disasm_bytes;
+    long long disasm_instructions;
+    long long listing_bytes;
+    long long executed;         // 6502 instructions run by -x
+    int includes;               // files read for INCLUDE
+    int token_cache_hits;       // of those, not tokenized again
+};
+
+// peephole optimizer (-O): rewrites are kept by instruction ordinal and applied by
+// assembling the source again, so every reference follows the code that moved
+
+enum edit_kind
+{
+    edit_none,
+    edit_drop,   // instruction removed
+    edit_jmp,    // JSR encoded as JMP
+    edit_target, // branch or jump to the target of the JMP it lands on
+    edit_jmp_target, // both: a tail call whose subroutine starts with a JMP
+};
+
+struct peephole_edit
+{
+    int kind;
+    text_view target; // edit_target, edit_jmp_target: operand of that JMP
+};
+
+// an instruction of the last pass, as seen by the peephole rules
+struct code_line
+{
+    int ordinal;
+    int address; // CPU address
+    int image;   // offset of its bytes
+    int length;
+    bool entry; // labelled, after data or a decoded jump target: code may arrive from elsewhere
+    text_view args;
+};
+
+enum peephole_rule
+{
+    rule_redundant_load, // STA m / LDA m
+    rule_carry_add,      // CLC / ADC #0, SEC / SBC #0
+    rule_tail_call,      // JSR sub / RTS
+    rule_jump_chain,     // branch or jump to a JMP
+    peephole_rule_count
+};
+
+struct peephole_stats
+{
+    int rewrites[peephole_rule_count];
+    int bytes;
+    int cycles; // per execution of each rewritten sequence
+};
+
+// input files are mapped read-only when possible, otherwise (pipes, devices) read into memory
+
+struct input_file
+{
+    unsigned char *data;
+    int size;
+    bool mapped;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+};
+
+bool read_input(FILE *f, input_file *in)
+{
+    int capacity = 0x10000;
+    in->data = (unsigned char *)malloc(capacity);
+    in->size = 0;
+    in->mapped = false;
+    for (;;)
+    {
+        if (in->size == capacity)
+        {
+            capacity *= 2;
+            in->data = (unsigned char *)realloc(in->data, capacity);
+        }
+        size_t n = fread(in->data + in->size, 1, capacity - in->size, f);
+        if (n == 0)
+        {
+            break;
+        }
+        in->size += (int)n;
+    }
+    return true;
+}
+
+bool open_input(const char *name, input_file *in)
+{
+    *in = {};
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if ((GetFileType(file) == FILE_TYPE_DISK) && GetFileSizeEx(file, &file_size) && (file_size.QuadPart > 0) && (file_size.QuadPart < 0x7FFFFFFF))
+    {
+        in->mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+        if (in->mapping)
+        {
+            in->data = (unsigned char *)MapViewOfFile(in->mapping, FILE_MAP_READ, 0, 0, 0);
+            if (in->data)
+            {
+                in->size = (int)file_size.QuadPart;
+                in->mapped = true;
+                CloseHandle(file);
+                return true;
+            }
+            CloseHandle(in->mapping);
+            in->mapping = 0;
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0) && (st.st_size < 0x7FFFFFFF))
+    {
+        void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            in->data = (unsigned char *)data;
+            in->size = (int)st.st_size;
+            in->mapped = true;
+            close(fd);
+            return true;
+        }
+    }
+    close(fd);
+#endif
+
+    FILE *f;
+    fopen_s(&f, name, "rb");
+    if (!f)
+    {
+        return false;
+    }
+    read_input(f, in);
+    fclose(f);
+    return true;
+}
+
+void close_input(input_file *in)
+{
+    if (in->mapped)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(in->data);
+        CloseHandle(in->mapping);
+#else
+        munmap(in->data, in->size);
+#endif
+    }
+    else
+    {
+        free(in->data);
+    }
+    *in = {};
+}
+
+// modification time, in nanoseconds where the platform has them
+bool file_stamp(const char *name, long long *stamp, long long *size)
+{
+    struct stat st;
+    if (stat(name, &st) != 0)
+    {
+        return false;
+    }
+#if defined(__linux__)
+    *stamp = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    *stamp = (long long)st.st_mtime;
+#endif
+    *size = (long long)st.st_size;
+    return true;
+}
+
+// INCLUDE "file" or INCSRC "file" assembles the lines of another source in place. every
+// file is read and tokenized once per assembly, all passes reuse it. the tokens are also
+// cached on disk, so a later build of a file with the same size and modification time
+// maps the cache instead of lexing it again
+
+#define TOKEN_CACHE_MAGIC 0x4B543641 // "A6TK"
+#define TOKEN_CACHE_VERSION 2
+#define MAX_INCLUDE_DEPTH 16
+
+// parse_line output as offsets into the file. lines without a label or op are left out
+struct token_line
+{
+    int label;
+    int label_length;
+    int op;
+    int op_length;
+    int args;
+    int args_length;
+};
+
+// the cache file is this header, the path and the token lines. a file is only used when
+// all of the key matches. each line is stored as six varints, the distance of every field
+// from the end of the one before it and the lengths, which is a few bytes for typical lines
+struct token_cache_header
+{
+    unsigned int magic;
+    unsigned int version;
+    long long size;
+    long long stamp; // file_stamp of the source
+    int line_count;
+    int path_length;
+    int token_bytes;
+};
+
+struct source_file
+{
+    char *path;
+    input_file in;
+    token_line *lines;
+    int line_count;
+};
+
+// symbol files (-s, IMPORT): the labels and defines of an assembly, laid out so other tools
+// can map the file and query it in place instead of parsing it. offsets are from the start
+// of the file, integers are in the byte order of the machine that wrote it
+//
+//   symfile_header
+//   symfile_entry[count]   sorted by value, then name: the address index
+//   int[hash_capacity]     open addressing by hash_symbol, entry index or -1: the name index
+//   names                  0 terminated
+
+#define SYMFILE_MAGIC 0x59533641 // "A6SY"
+#define SYMFILE_VERSION 1
+
+enum symfile_kind
+{
+    symfile_define,
+    symfile_label,
+};
+
+struct symfile_header
+{
+    unsigned int magic;
+    unsigned int version;
+    int count;
+    int hash_capacity; // a power of 2, at least twice count
+    int entries;
+    int hash_slots;
+    int names;
+    int names_size;
+};
+
+struct symfile_entry
+{
+    int value;
+    unsigned int hash; // hash_symbol of the name
+    int name;          // offset in names
+    int name_length;
+    int kind;
+};
+
+// an IMPORT, checked by symfile_valid when it was loaded
+struct symbol_file
+{
+    char *path;
+    input_file in;
+};
+
+// the symbol called name, case insensitive like the assembler's own tables, or 0. defines
+// come first in the probe sequence when a name is both
+const symfile_entry *symfile_find(const unsigned char *file, const char *name, int length)
+{
+    const symfile_header *h = (const symfile_header *)file;
+    const symfile_entry *entries = (const symfile_entry *)(file + h->entries);
+    const int *slots = (const int *)(file + h->hash_slots);
+    const char *names = (const char *)(file + h->names);
+    unsigned int hash = hash_symbol(name, length);
+    int mask = h->hash_capacity - 1;
+    for (int i = hash & mask; slots[i] >= 0; i = (i + 1) & mask)
+    {
+        const symfile_entry *e = &entries[slots[i]];
+        if ((e->hash == hash) && (e->name_length == length) && (_strnicmp(names + e->name, name, length) == 0))
+        {
+            return e;
+        }
+    }
+    return 0;
+}
+
+// the last symbol at or below value, 0 if there is none: what a debugger shows for an address
+const symfile_entry *symfile_nearest(const unsigned char *file, int value)
+{
+    const symfile_header *h = (const symfile_header *)file;
+    const symfile_entry *entries = (const symfile_entry *)(file + h->entries);
+    int low = 0;
+    int high = h->count;
+    while (low < high)
+    {
+        int middle = low + (high - low) / 2;
+        if (entries[middle].value <= value)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low ? &entries[low - 1] : 0;
+}
+
+// every offset of the file is inside it, so the queries above can trust it
+bool symfile_valid(const unsigned char *file, int size)
+{
+    const symfile_header *h = (const symfile_header *)file;
+    if ((size < (int)sizeof(symfile_header)) || (h->magic != SYMFILE_MAGIC) || (h->version != SYMFILE_VERSION) ||
+        (h->count < 0) || (h->hash_capacity <= h->count) || (h->hash_capacity & (h->hash_capacity - 1)) ||
+        (h->entries < (int)sizeof(symfile_header)) || (h->entries % 4) || (h->hash_slots % 4) || (h->names < 0) || (h->names_size < 0) ||
+        (h->entries + h->count * (long long)sizeof(symfile_entry) > size) ||
+        (h->hash_slots < 0) || (h->hash_slots + h->hash_capacity * (long long)sizeof(int) > size) ||
+        ((long long)h->names + h->names_size > size))
+    {
+        return false;
+    }
+    const symfile_entry *entries = (const symfile_entry *)(file + h->entries);
+    for (int i = 0; i < h->count; i++)
+    {
+        if ((entries[i].name < 0) || (entries[i].name_length < 0) || ((long long)entries[i].name + entries[i].name_length > h->names_size))
+        {
+            return false;
+        }
+    }
+    // symfile_find stops at an empty slot, there has to be one
+    const int *slots = (const int *)(file + h->hash_slots);
+    int empty = 0;
+    for (int i = 0; i < h->hash_capacity; i++)
+    {
+        if ((slots[i] < -1) || (slots[i] >= h->count))
+        {
+            return false;
+        }
+        empty += (slots[i] == -1);
+    }
+    return empty > 0;
+}
+
+// a populated range of the output image
+struct segment
+{
+    int start;   // in the image
+    int length;
+    int address; // where the CPU sees it
+    int bank;
+};
+
+struct assembler
+{
+    arena memory;
+    symbol_table labels;
+    symbol_table defines;
+    symbol_table unresolved; // symbol::offset = head of the fixup chain, -1 once resolved
+
+    fixup *fixups;
+    int fixup_count;
+    int fixup_capacity;
+
+    // layout passes, see translate_program
+    int pass;
+    bool layout_changed;
+    bool quiet;               // errors are only reported by the first pass
+    int report_count;         // messages, quiet ones included
+    unsigned char *layout_sizes; // size of every instruction in the previous pass
+    int layout_count;
+    int layout_capacity;
+
+    bool optimize;
+    peephole_edit *edits; // by instruction ordinal
+    int edit_count;
+    code_line *code;
+    int code_count;
+    int code_capacity;
+    bool code_entry; // the next instruction is an entry
+    peephole_stats saved;
+
+    segment *segments; // written by the last pass, sorted and merged when it ends
+    int segment_count;
+    int segment_capacity;
+
+    // BANK directive: bytes for CPU address a go to out_data[a + image_delta]
+    int bank;
+    int bank_size;
+    int image_delta;
+    int window_start; // CPU addresses of the current bank, both 0 when unbanked
+    int window_end;
+    bool window_reported;
+
+    // included files and imported symbol files, kept until the next asm_program
+    const char *source_name; // the main file, includes are relative to the file including them
+    source_file *sources;
+    int source_count;
+    int source_capacity;
+    int include_depth;
+    const char *include_stack[MAX_INCLUDE_DEPTH]; // paths of the files being included, innermost last
+    symbol_file *imports;
+    int import_count;
+    int import_capacity;
+
+    unsigned char *out_data; // zero outside the segments
+    output_buffer *log; // error messages
+    asm_stats *stats;   // 0 unless --stats
+};
+
+#define OUT_BUFFER_SIZE 0x10000
+
+// the output image, banks included. reserved once, the OS only backs the pages written
+#define IMAGE_SIZE (16 * 1024 * 1024)
+
+void assembler_init(assembler *as, output_buffer *log)
+{
+    *as = {};
+    as->labels.memory = &as->memory;
+    as->defines.memory = &as->memory;
+    as->unresolved.memory = &as->memory;
+    as->out_data = (unsigned char *)calloc(IMAGE_SIZE, 1);
+    as->log = log;
+}
+
+void free_fixups(assembler *as)
+{
+    as->fixups = 0;
+    as->fixup_count = 0;
+    as->fixup_capacity = 0;
+    free_symbols(&as->unresolved);
+}
+
+// O(1), everything allocated by the previous assembly is owned by the arena
+void assembler_reset(assembler *as)
+{
+    free_symbols(&as->labels);
+    free_symbols(&as->defines);
+    free_fixups(as);
+    arena_reset(&as->memory);
+    as->pass = 0;
+    as->layout_count = 0;
+    as->edit_count = 0;
+    as->bank = 0;
+    as->bank_size = 0;
+    as->image_delta = 0;
+    as->source_name = 0;
+}
+
+void free_sources(assembler *as)
+{
+    for (int i = 0; i < as->source_count; i++)
+    {
+        free(as->sources[i].path);
+        free(as->sources[i].lines);
+        close_input(&as->sources[i].in);
+    }
+    as->source_count = 0;
+    for (int i = 0; i < as->import_count; i++)
+    {
+        free(as->imports[i].path);
+        close_input(&as->imports[i].in);
+    }
+    as->import_count = 0;
+}
+
+void assembler_free(assembler *as)
+{
+    free_sources(as);
+    free(as->sources);
+    free(as->imports);
+    free(as->layout_sizes);
+    free(as->edits);
+    free(as->code);
+    free(as->segments);
+    arena_free(&as->memory);
+    free(as->out_data);
+    *as = {};
+}
+
+void report(assembler *as, const char *format, ...)
+{
+    as->report_count++;
+    if (as->quiet)
+    {
+        return;
+    }
+
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (length >= (int)sizeof(message))
+    {
+        length = sizeof(message) - 1;
+    }
+
+    if (as->log)
+    {
+        output_write(as->log, message, length);
+    }
+    else
+    {
+        fwrite(message, 1, length, stdout);
+    }
+}
+
+int lookup(assembler *as, const char *text, int length)
+{
+    int address = lookup_symbol(&as->defines, text, length);
+    if (address == INVALID_ADDRESS)
+    {
+        address = lookup_symbol(&as->labels, text, length);
+    }
+    for (int i = 0; (address == INVALID_ADDRESS) && (i < as->import_count); i++)
+    {
+        const symfile_entry *e = symfile_find(as->imports[i].in.data, text, length);
+        if (e)
+        {
+            address = e->value;
+        }
+    }
+    if (as->stats)
+    {
+        if (address == INVALID_ADDRESS)
+        {
+            as->stats->symbol_misses++;
+        }
+        else
+        {
+            as->stats->symbol_hits++;
+        }
+    }
+    return address;
+}
+
+void print_symbols(symbol_table *table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        symbol *s = &table->slots[i];
+        if (s->label)
+        {
+            printf("%04x    %.*s\n", s->offset, s->length, s->label);
+        }
+    }
+}
+
+struct symfile_source
+{
+    const symbol *s;
+    int kind;
+};
+
+int compare_symfile_source(const void *a, const void *b)
+{
+    const symbol *x = ((const symfile_source *)a)->s;
+    const symbol *y = ((const symfile_source *)b)->s;
+    if (x->offset != y->offset)
+    {
+        return (x->offset < y->offset) ? -1 : 1;
+    }
+    int order = memcmp(x->label, y->label, (x->length < y->length) ? x->length : y->length);
+    return order ? order : x->length - y->length;
+}
+
+// -s: the defines and labels of the last assembly. imported symbols are not written again
+void write_symbols(assembler *as, output_buffer *out)
+{
+    symbol_table *tables[2] = { &as->defines, &as->labels };
+    symfile_source *sorted = (symfile_source *)malloc((as->defines.count + as->labels.count + 1) * sizeof(symfile_source));
+    int count = 0;
+    int names_size = 0;
+    for (int t = 0; t < 2; t++)
+    {
+        for (int i = 0; i < tables[t]->capacity; i++)
+        {
+            const symbol *s = &tables[t]->slots[i];
+            if (s->label && (s->offset != INVALID_ADDRESS))
+            {
+                sorted[count++] = { s, (t == 0) ? symfile_define : symfile_label };
+                names_size += s->length + 1;
+            }
+        }
+    }
+    qsort(sorted, count, sizeof(symfile_source), compare_symfile_source);
+
+    symfile_header header;
+    header.magic = SYMFILE_MAGIC;
+    header.version = SYMFILE_VERSION;
+    header.count = count;
+    header.hash_capacity = 2;
+    while (header.hash_capacity < count * 2)
+    {
+        header.hash_capacity *= 2;
+    }
+    header.entries = sizeof(symfile_header);
+    header.hash_slots = header.entries + count * sizeof(symfile_entry);
+    header.names = header.hash_slots + header.hash_capacity * sizeof(int);
+    header.names_size = names_size;
+
+    symfile_entry *entries = (symfile_entry *)malloc((count + 1) * sizeof(symfile_entry));
+    int name = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const symbol *s = sorted[i].s;
+        entries[i] = { s->offset, s->hash, name, s->length, sorted[i].kind };
+        name += s->length + 1;
+    }
+
+    // defines first, lookup finds them before a label of the same name
+    int *slots = (int *)malloc(header.hash_capacity * sizeof(int));
+    memset(slots, 0xFF, header.hash_capacity * sizeof(int));
+    int mask = header.hash_capacity - 1;
+    for (int kind = symfile_define; kind <= symfile_label; kind++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (entries[i].kind == kind)
+            {
+                int j = entries[i].hash & mask;
+                while (slots[j] >= 0)
+                {
+                    j = (j + 1) & mask;
+                }
+                slots[j] = i;
+            }
+        }
+    }
+
+    output_write(out, (const char *)&header, sizeof(header));
+    output_write(out, (const char *)entries, count * sizeof(symfile_entry));
+    output_write(out, (const char *)slots, header.hash_capacity * sizeof(int));
+    for (int i = 0; i < count; i++)
+    {
+        char *p = output_reserve(out, sorted[i].s->length + 1);
+        memcpy(p, sorted[i].s->label, sorted[i].s->length);
+        p[sorted[i].s->length] = 0;
+        out->used += sorted[i].s->length + 1;
+    }
+
+    free(slots);
+    free(entries);
+    free(sorted);
+}
+
+void print_symbol_stats(symbol_table *table, const char *name)
+{
+    printf("%-8s symbols: %d  capacity: %d  lookups: %d  avg probes: %.2f  max probes: %d\n",
+        name, table->count, table->capacity, table->lookups,
+        table->lookups ? (double)table->probes / table->lookups : 0.0, table->max_probes);
+}
+
+enum stats_format
+{
+    stats_off,
+    stats_text,
+    stats_json,
+};
+
+void print_stats(assembler *as, const char *name, stats_format format)
+{
+    asm_stats *st = as->stats;
+    symbol_table *tables[3] = { &as->labels, &as->defines, &as->unresolved };
+    long long lookups = 0, probes = 0;
+    int max_probes = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        lookups += tables[i]->lookups;
+        probes += tables[i]->probes;
+        max_probes = (tables[i]->max_probes > max_probes) ? tables[i]->max_probes : max_probes;
+    }
+
+    if (format == stats_json)
+    {
+        // one object per line, with the file name escaped
+        char escaped[200];
+        int length = 0;
+        for (const char *c = name; *c && (length < (int)sizeof(escaped) - 2); c++)
+        {
+            if ((*c == '"') || (*c == '\\'))
+            {
+                escaped[length++] = '\\';
+            }
+            escaped[length++] = *c;
+        }
+        escaped[length] = 0;
+
+        report(as, "{ \"file\": \"%s\", \"passes\": %d, ", escaped, st->passes);
+        report(as, "\"load_s\": %.6f, \"translate_s\": %.6f, \"unresolved_s\": %.6f, \"listing_s\": %.6f, ",
+            st->load_seconds, st->translate_seconds, st->unresolved_seconds, st->listing_seconds);
+        report(as, "\"lines\": %lld, \"instructions\": %lld, \"opcode_probes\": %lld, \"bytes_emitted\": %lld, \"dcb_bytes\": %lld, \"fixups\": %lld, ",
+            st->lines, st->instructions, st->opcode_probes, st->bytes_emitted, st->dcb_bytes, st->fixups);
+        report(as, "\"symbol_hits\": %lld, \"symbol_misses\": %lld, \"symbol_lookups\": %lld, \"symbol_probes\": %lld, \"symbol_max_probes\": %d, ",
+            st->symbol_hits, st->symbol_misses, lookups, probes, max_probes);
+        report(as, "\"disasm_bytes\": %lld, \"disasm_instructions\": %lld, \"listing_bytes\": %lld, ",
+            st->disasm_bytes, st->disasm_instructions, st->listing_bytes);
+        report(as, "\"includes\": %d, \"token_cache_hits\": %d, ", st->includes, st->token_cache_hits);
+        report(as, "\"execute_s\": %.6f, \"executed\": %lld }\n", st->execute_seconds, st->executed);
+        return;
+    }
+
+    report(as, "Stats: %s\n", name);
+    report(as, "  load:             %10.6f s\n", st->load_seconds);
+    report(as, "  translate:        %10.6f s  (%d pass%s)\n", st->translate_seconds, st->passes, (st->passes == 1) ? "" : "es");
+    report(as, "  unresolved check: %10.6f s\n", st->unresolved_seconds);
+    report(as, "  listing:          %10.6f s\n", st->listing_seconds);
+    report(as, "  lines:            %10lld\n", st->lines);
+    if (st->includes)
+    {
+        report(as, "  includes:         %10d  token cache hits: %d\n", st->includes, st->token_cache_hits);
+    }
+    report(as, "  instructions:     %10lld  opcode probes: %lld\n", st->instructions, st->opcode_probes);
+    report(as, "  bytes emitted:    %10lld  DCB bytes: %lld\n", st->bytes_emitted, st->dcb_bytes);
+    report(as, "  fixups:           %10lld\n", st->fixups);
+    report(as, "  symbol lookups:   %10lld  hits: %lld  misses: %lld\n", st->symbol_hits + st->symbol_misses, st->symbol_hits, st->symbol_misses);
+    report(as, "  table probes:     %10lld  in %lld lookups, max %d\n", probes, lookups, max_probes);
+    report(as, "  disassembly:      %10lld bytes  %lld instructions  %lld listing bytes\n",
+        st->disasm_bytes, st->disasm_instructions, st->listing_bytes);
+    if (st->executed)
+    {
+        report(as, "  execute:          %10.6f s  %lld instructions  %.0f instructions/s\n",
+            st->execute_seconds, st->executed, st->execute_seconds > 0 ? st->executed / st->execute_seconds : 0.0);
+    }
+}
+
+int parse_value(const char *text, int length)
+{
+    const char *end = text + length;
+    int value = 0;
+    if ((text < end) && (*text == '$'))
+    {
+        text++; // skip hex prefix
+        while (text < end)
+        {
+            if ((*text >= '0') && (*text <= '9'))
+            {
+                value = value * 16 + (*text - '0');
+                text++;
+            }
+            else if ((*text >= 'A') && (*text <= 'F'))
+            {
+                value = value * 16 + (*text - 'A' + 10);
+                text++;
+            }
+            else if ((*text >= 'a') && (*text <= 'f'))
+            {
+                value = value * 16 + (*text - 'a' + 10);
+                text++;
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        while (text < end)
+        {
+            if ((*text >= '0') && (*text <= '9'))
+            {
+                value = value * 10 + (*text - '0');
+                text++;
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+    return value;
+}
+
+// expressions: + - * / & | ^ << >> with C precedence, parentheses and unary minus. a leading
+// < or > selects the low or high byte of the whole expression. operands are decimal, $hex,
+// %binary, 'c' characters, symbols and * for the current address. constant subexpressions
+// are folded while compiling, so a literal operand compiles to a single op
+
+// 32-bit two's complement arithmetic, results wrap instead of overflowing
+inline int expr_apply(int kind, int a, int b)
+{
+    switch (kind)
+    {
+        case expr_neg: return (int)(0u - (unsigned int)a);
+        case expr_lo:  return a & 0xFF;
+        case expr_hi:  return (a >> 8) & 0xFF;
+        case expr_bank: return (a >> 16) & 0xFF;
+        case expr_mul: return (int)((unsigned int)a * (unsigned int)b);
+        case expr_div: return (b == 0) ? 0 : (b == -1) ? (int)(0u - (unsigned int)a) : a / b;
+        case expr_add: return (int)((unsigned int)a + (unsigned int)b);
+        case expr_sub: return (int)((unsigned int)a - (unsigned int)b);
+        case expr_shl: return (int)((unsigned int)a << (b & 31));
+        case expr_shr: return a >> (b & 31);
+        case expr_and: return a & b;
+        case expr_xor: return a ^ b;
+        case expr_or:  return a | b;
+        default:
+            assert(!"invalid code path");
+            return 0;
+    }
+}
+
+struct expr_parser
+{
+    const char *text;
+    int length;
+    int pos;
+    expr *e;
+    bool error;
+};
+
+#define _peek(i) ((p->pos + (i) < p->length) ? p->text[p->pos + (i)] : 0)
+
+inline void expr_skip_spaces(expr_parser *p)
+{
+    while ((_peek(0) == ' ') || (_peek(0) == '\t'))
+    {
+        p->pos++;
+    }
+}
+
+// appends an op, folding it into the previous ones when its operands are constants
+void expr_emit(expr_parser *p, int kind, int value, int length)
+{
+    expr *e = p->e;
+    if ((kind >= expr_mul) && (e->count >= 2) && (e->ops[e->count - 1].kind == expr_const) && (e->ops[e->count - 2].kind == expr_const))
+    {
+        e->ops[e->count - 2].value = expr_apply(kind, e->ops[e->count - 2].value, e->ops[e->count - 1].value);
+        e->count--;
+        return;
+    }
+    if ((kind >= expr_neg) && (kind < expr_mul) && (e->count >= 1) && (e->ops[e->count - 1].kind == expr_const))
+    {
+        e->ops[e->count - 1].value = expr_apply(kind, e->ops[e->count - 1].value, 0);
+        return;
+    }
+    if (e->count == EXPR_MAX_OPS)
+    {
+        p->error = true;
+        return;
+    }
+    e->ops[e->count++] = { kind, value, length };
+}
+
+// binary operator at the current position, -1 if there is none
+int expr_operator(expr_parser *p, int *precedence, int *length)
+{
+    *length = 1;
+    switch (_peek(0))
+    {
+        case '*': *precedence = 5; return expr_mul;
+        case '/': *precedence = 5; return expr_div;
+        case '+': *precedence = 4; return expr_add;
+        case '-': *precedence = 4; return expr_sub;
+        case '&': *precedence = 2; return expr_and;
+        case '^': *precedence = 1; return expr_xor;
+        case '|': *precedence = 0; return expr_or;
+        case '<':
+        case '>':
+            if (_peek(1) == _peek(0))
+            {
+                *length = 2;
+                *precedence = 3;
+                return (_peek(0) == '<') ? expr_shl : expr_shr;
+            }
+            return -1;
+        default:
+            return -1;
+    }
+}
+
+void expr_select(expr_parser *p);
+
+void expr_primary(expr_parser *p)
+{
+    expr_skip_spaces(p);
+    char c = _peek(0);
+    int value = 0;
+    if (c == '(')
+    {
+        p->pos++;
+        expr_select(p);
+        expr_skip_spaces(p);
+        if (_peek(0) != ')')
+        {
+            p->error = true;
+            return;
+        }
+        p->pos++;
+    }
+    else if ((c == '$') || (c == '%'))
+    {
+        int base = (c == '$') ? 16 : 2;
+        int digits = 0;
+        for (p->pos++; ; p->pos++, digits++)
+        {
+            char d = _peek(0);
+            int digit = ((d >= '0') && (d <= '9')) ? d - '0' : ((d >= 'A') && (d <= 'F')) ? d - 'A' + 10 : ((d >= 'a') && (d <= 'f')) ? d - 'a' + 10 : 99;
+            if (digit >= base)
+            {
+                break;
+            }
+            value = (int)((unsigned int)value * base + digit); // wraps like expr_apply
+        }
+        p->error |= (digits == 0);
+        expr_emit(p, expr_const, value, 0);
+    }
+    else if ((c >= '0') && (c <= '9'))
+    {
+        while ((_peek(0) >= '0') && (_peek(0) <= '9'))
+        {
+            value = (int)((unsigned int)value * 10 + (_peek(0) - '0'));
+            p->pos++;
+        }
+        expr_emit(p, expr_const, value, 0);
+    }
+    else if (c == '\'')
+    {
+        if ((p->pos + 2 >= p->length) || (_peek(2) != '\''))
+        {
+            p->error = true;
+            return;
+        }
+        expr_emit(p, expr_const, (unsigned char)_peek(1), 0);
+        p->pos += 3;
+    }
+    else if (c == '*')
+    {
+        p->pos++;
+        expr_emit(p, expr_pc, 0, 0);
+    }
+    else if (is_ident_char(c))
+    {
+        int start = p->pos;
+        while (is_ident_char(_peek(0)))
+        {
+            p->pos++;
+        }
+        expr_emit(p, expr_symbol, start, p->pos - start);
+    }
+    else
+    {
+        p->error = true;
+    }
+}
+
+void expr_unary(expr_parser *p)
+{
+    expr_skip_spaces(p);
+    if (_peek(0) == '-')
+    {
+        p->pos++;
+        expr_unary(p);
+        expr_emit(p, expr_neg, 0, 0);
+        return;
+    }
+    expr_primary(p);
+}
+
+// precedence climbing, all binary operators are left associative
+void expr_binary(expr_parser *p, int min_precedence)
+{
+    expr_unary(p);
+    while (!p->error)
+    {
+        expr_skip_spaces(p);
+        int precedence, length;
+        int kind = expr_operator(p, &precedence, &length);
+        if ((kind < 0) || (precedence < min_precedence))
+        {
+            break;
+        }
+        p->pos += length;
+        expr_binary(p, precedence + 1);
+        expr_emit(p, kind, 0, 0);
+    }
+}
+
+void expr_select(expr_parser *p)
+{
+    expr_skip_spaces(p);
+    char c = _peek(0);
+    if ((c == '<') || (c == '>') || (c == '^'))
+    {
+        p->pos++;
+        expr_binary(p, 0);
+        expr_emit(p, (c == '<') ? expr_lo : (c == '>') ? expr_hi : expr_bank, 0, 0);
+    }
+    else
+    {
+        expr_binary(p, 0);
+    }
+}
+
+#undef _peek
+
+// compiles the expression at the start of text, up to a ',' or ')' outside parentheses
+// returns the number of characters used, or -1 on a syntax error
+int compile_expr(const char *text, int length, expr *e)
+{
+    e->text = text;
+    e->count = 0;
+    expr_parser p = { text, length, 0, e, false };
+    expr_select(&p);
+    expr_skip_spaces(&p);
+    return p.error ? -1 : p.pos;
+}
+
+// false if the expression uses a symbol that is not defined yet, *missing is the first one
+bool eval_expr(assembler *as, const char *text, const expr_op *ops, int count, int pc, int *value, text_view *missing)
+{
+    int stack[EXPR_MAX_OPS];
+    int top = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const expr_op *op = &ops[i];
+        switch (op->kind)
+        {
+            case expr_const:
+                stack[top++] = op->value;
+                break;
+            case expr_pc:
+                stack[top++] = pc;
+                break;
+            case expr_symbol:
+            {
+                int address = lookup(as, text + op->value, op->length);
+                if (address == INVALID_ADDRESS)
+                {
+                    *missing = { text + op->value, op->length };
+                    return false;
+                }
+                stack[top++] = address;
+                break;
+            }
+            case expr_neg:
+            case expr_lo:
+            case expr_hi:
+            case expr_bank:
+                stack[top - 1] = expr_apply(op->kind, stack[top - 1], 0);
+                break;
+            default:
+                top--;
+                stack[top - 1] = expr_apply(op->kind, stack[top - 1], stack[top]);
+                break;
+        }
+    }
+    *value = count ? stack[0] : 0;
+    return true;
+}
+
+// value used for sizing while an expression is deferred: a byte select can't exceed $FF,
+// anything else is assumed to need a full word
+inline int deferred_value(const expr_op *ops, int count)
+{
+    int kind = count ? ops[count - 1].kind : expr_const;
+    return ((kind == expr_lo) || (kind == expr_hi) || (kind == expr_bank)) ? 0xFF : INVALID_ADDRESS;
+}
+
+// compiles and evaluates a whole field (DEFINE value, origin), reporting syntax errors
+bool eval_field(assembler *as, text_view field, int pc, expr *e, int *value, text_view *missing)
+{
+    int used = compile_expr(field.text, field.length, e);
+    if ((used < 0) || (used != field.length))
+    {
+        report(as, "Invalid expression: %.*s\n", field.length, field.text);
+        e->count = 0;
+    }
+    return eval_expr(as, e->text, e->ops, e->count, pc, value, missing);
+}
+
+// instruction operand
+struct operand_ref
+{
+    expr value;        // count 0 if there is no operand
+    bool defined;      // false = depends on a forward reference (or undefined symbol)
+    text_view missing; // the first symbol not defined yet
+};
+
+// an operand starting with '(' is indirect unless the matching ')' is followed by more expression
+bool is_indirect(const char *c, const char *end)
+{
+    int depth = 0;
+    for (; c < end; c++)
+    {
+        if ((*c == '\'') && (c + 2 < end))
+        {
+            c += 2;
+        }
+        else if (*c == '(')
+        {
+            depth++;
+        }
+        else if ((*c == ')') && (--depth == 0))
+        {
+            break;
+        }
+    }
+    for (c++; (c < end) && ((*c == ' ') || (*c == '\t')); c++)
+    {
+    }
+    return (c >= end) || (*c == ',');
+}
+
+address_mode get_address_mode(assembler *as, text_view args, int pc, int *ptr_address, operand_ref *ptr_ref)
+{
+    address_mode mode = address_mode_undef;
+    const char *c = args.text;
+    const char *end = args.text + args.length;
+    bool valid = true;
+
+#define _peek(i) ((c + (i) < end) ? c[i] : 0)
+#define _skip_spaces while ((_peek(0) == ' ') || (_peek(0) == '\t')) {c++;}
+#define _compile \
+    { \
+        int used = compile_expr(c, (int)(end - c), &ptr_ref->value); \
+        valid = (used >= 0); \
+        c += valid ? used : 0; \
+    }
+
+    ptr_ref->value.count = 0;
+
+    _skip_spaces;
+
+    const char *after = c + 1;
+    while ((after < end) && ((*after == ' ') || (*after == '\t')))
+    {
+        after++;
+    }
+
+    if (_peek(0) == 0)
+    {
+        mode = address_mode_imp;
+    }
+    else if (((_peek(0) == 'A') || (_peek(0) == 'a')) && (after == end))
+    {
+        mode = address_mode_acc;
+        c = end;
+    }
+    else if (_peek(0) == '#')
+    {
+        mode = address_mode_imm;
+        c++;
+        _compile;
+    }
+    else if ((_peek(0) == '(') && is_indirect(c, end))
+    {
+        mode = address_mode_ind;
+        c++;
+        _compile;
+        if (_peek(0) == ',')
+        {
+            c++;
+            _skip_spaces;
+            if ((_peek(0) == 'x') || (_peek(0) == 'X'))
+            {
+                mode = address_mode_ind_x;
+                c++;
+                _skip_spaces;
+            }
+            else
+            {
+                assert(!"invalid mode");
+            }
+        }
+        assert(_peek(0) == ')');
+        c++;
+        _skip_spaces;
+        if ((_peek(0) == ',') && (mode == address_mode_ind))
+        {
+            c++;
+            _skip_spaces;
+            if ((_peek(0) == 'y') || (_peek(0) == 'Y'))
+            {
+                mode = address_mode_ind_y;
+                c++;
+            }
+            else
+            {
+                assert(!"invalid mode");
+            }
+        }
+    }
+    else
+    {
+        mode = address_mode_abs;
+        _compile;
+        if (_peek(0) == ',')
+        {
+            c++;
+            _skip_spaces;
+            if ((_peek(0) == 'x') || (_peek(0) == 'X'))
+            {
+                mode = address_mode_abs_x;
+                c++;
+            }
+            else if ((_peek(0) == 'y') || (_peek(0) == 'Y'))
+            {
+                mode = address_mode_abs_y;
+                c++;
+            }
+            else
+            {
+                assert(!"invalid mode");
+            }
+        }
+    }
+
+    _skip_spaces;
+
+    if (!valid || (_peek(0) != 0))
+    {
+        report(as, "Invalid operand: %.*s\n", args.length, args.text);
+        ptr_ref->value.count = 0;
+    }
+
+    assert(mode != address_mode_undef);
+
+#undef _compile
+#undef _skip_spaces
+#undef _peek
+
+    expr *e = &ptr_ref->value;
+    int address = 0;
+    ptr_ref->defined = eval_expr(as, e->text, e->ops, e->count, pc, &address, &ptr_ref->missing);
+    *ptr_address = ptr_ref->defined ? address : deferred_value(e->ops, e->count);
+    return mode;
+}
+
+// min_length keeps a larger encoding chosen by an earlier layout pass: 3 = absolute
+// instead of zero page, 5 = long branch
+int translate_instruction(text_view op, address_mode mode, int current_address, int parsed_address, int min_length, unsigned char *out, int *probes)
+{
+    parsed_address = cpu_address(parsed_address);
+    int m = mnemonic_id(op.text, op.length, probes);
+    if (m < 0)
+    {
+        assert(!"invalid op/mode");
+        return 0;
+    }
+
+    const short *modes = encoder[m];
+    int id = -1;
+
+    // special case: branch instructions have relative addressing
+    if ((modes[address_mode_rel] >= 0) && (mode == address_mode_abs))
+    {
+        id = modes[address_mode_rel];
+        int distance = parsed_address - current_address - 2;
+        if ((parsed_address != INVALID_ADDRESS) && ((distance < -128) || (distance > 127) || (min_length == 5)))
+        {
+            // out of range: the inverted branch skips over a JMP to the target
+            out[0] = id ^ 0x20;
+            out[1] = 3;
+            out[2] = OP_JMP;
+            out[3] = parsed_address & 0xFF;
+            out[4] = (parsed_address >> 8) & 0xFF;
+            return 5;
+        }
+        parsed_address = distance;
+    }
+    else if ((modes[address_mode_acc] >= 0) && (mode == address_mode_imp))
+    {
+        id = modes[address_mode_acc];
+    }
+    else if ((parsed_address <= 0xFF) && (min_length < 3))
+    {
+        // prefer zp addressing when available
+        if (mode == address_mode_abs)
+        {
+            id = modes[address_mode_zp];
+        }
+        else if (mode == address_mode_abs_x)
+        {
+            id = modes[address_mode_zp_x];
+        }
+        else if (mode == address_mode_abs_y)
+        {
+            id = modes[address_mode_zp_y];
+        }
+    }
+    if (id < 0)
+    {
+        id = modes[mode];
+    }
+    if (id < 0)
+    {
+        assert(!"invalid op/mode");
+        return 0;
+    }
+
+    out[0] = id;
+    if (opcodes[id].length == 2)
+    {
+        out[1] = parsed_address & 0xFF;
+    }
+    else if (opcodes[id].length == 3)
+    {
+        out[1] = parsed_address & 0xFF;
+        out[2] = (parsed_address >> 8) & 0xFF;
+    }
+    return opcodes[id].length;
+}
+
+// forward references are emitted with a placeholder value and patched when the symbol is defined
+// pending fixups for a symbol are chained through fixup::next, the head is kept in the unresolved table
+
+// links fixup index into the chain of the symbol it waits for
+void chain_fixup(assembler *as, int index, text_view missing)
+{
+    bool existed;
+    symbol *s = insert_symbol(&as->unresolved, missing.text, missing.length, &existed);
+    as->fixups[index].next = existed ? s->offset : -1;
+    s->offset = index;
+}
+
+void add_fixup(assembler *as, const char *text, const expr_op *ops, int count, text_view missing, int address, fixup_kind kind, text_view name)
+{
+    if (as->pass > 1)
+    {
+        // every symbol the program defines is known from the first pass
+        return;
+    }
+    if (as->fixup_count == as->fixup_capacity)
+    {
+        // old array is abandoned, the memory is owned by the arena
+        as->fixup_capacity = as->fixup_capacity ? as->fixup_capacity * 2 : 256;
+        fixup *grown = (fixup *)arena_alloc(&as->memory, as->fixup_capacity * sizeof(fixup));
+        if (as->fixup_count)
+        {
+            memcpy(grown, as->fixups, as->fixup_count * sizeof(fixup));
+        }
+        as->fixups = grown;
+    }
+
+    fixup *f = &as->fixups[as->fixup_count];
+    f->address = address;
+    f->image = address + as->image_delta;
+    f->kind = kind;
+    f->text = text;
+    f->ops = (expr_op *)arena_alloc(&as->memory, count * sizeof(expr_op));
+    memcpy(f->ops, ops, count * sizeof(expr_op));
+    f->count = count;
+    f->name = name;
+    chain_fixup(as, as->fixup_count++, missing);
+}
+
+inline fixup_kind instruction_fixup(int id)
+{
+    if (opcodes[id].mode == address_mode_rel)
+    {
+        return fixup_rel;
+    }
+    return (opcodes[id].length == 3) ? fixup_word : fixup_byte;
+}
+
+void define_constant(assembler *as, text_view name, int value, unsigned char *bytes);
+
+// called when a symbol gets defined: every expression waiting for it is evaluated again and
+// either patched or chained to the next symbol it still waits for
+void resolve_fixups(assembler *as, const char *text, int length, unsigned char *bytes)
+{
+    symbol *s = find_symbol(&as->unresolved, text, length);
+    if (!s || (s->offset < 0))
+    {
+        return;
+    }
+    int i = s->offset;
+    s->offset = -1; // s is not used below, chaining can grow the table
+
+    while (i >= 0)
+    {
+        fixup *f = &as->fixups[i];
+        int next = f->next;
+        int value;
+        text_view missing;
+        if (!eval_expr(as, f->text, f->ops, f->count, f->address, &value, &missing))
+        {
+            chain_fixup(as, i, missing);
+        }
+        else if (f->kind == fixup_define)
+        {
+            define_constant(as, f->name, value, bytes);
+        }
+        else
+        {
+            unsigned char *out = bytes + f->image;
+            int distance = cpu_address(value) - f->address - 2;
+            switch (f->kind)
+            {
+                case fixup_rel:
+                    out[1] = distance & 0xFF;
+                    as->layout_changed |= (distance < -128) || (distance > 127);
+                    break;
+                case fixup_word:
+                    as->layout_changed |= (cpu_address(value) >= 0) && (cpu_address(value) <= 0xFF) && (encoder_data.zero_page[out[0]] >= 0);
+                    out[1] = value & 0xFF;
+                    out[2] = (value >> 8) & 0xFF;
+                    break;
+                case fixup_byte:
+                    out[1] = value & 0xFF;
+                    break;
+                default:
+                    out[0] = value & 0xFF;
+                    break;
+            }
+        }
+        i = next;
+    }
+}
+
+// defines the symbol for this pass, false if it already was. a later layout pass moving
+// a symbol means the values used for forward references were stale
+bool set_symbol(assembler *as, symbol_table *table, text_view name, int value)
+{
+    bool existed;
+    symbol *s = insert_symbol(table, name.text, name.length, &existed);
+    if (existed && (s->pass == as->pass))
+    {
+        return false;
+    }
+    if (existed && (s->offset != value))
+    {
+        as->layout_changed = true;
+    }
+    s->offset = value;
+    s->pass = as->pass;
+    return true;
+}
+
+void define_label(assembler *as, text_view label, int offset, unsigned char *bytes)
+{
+    if (set_symbol(as, &as->labels, label, (as->bank << 16) | offset))
+    {
+        resolve_fixups(as, label.text, label.length, bytes);
+    }
+    else
+    {
+        report(as, "Duplicate label: %.*s\n", label.length, label.text);
+    }
+}
+
+// DEFINE args are "symbol expression"
+void split_define(text_view args, text_view *name, text_view *value)
+{
+    *name = args;
+    for (int i = 0; i < args.length; i++)
+    {
+        if ((args.text[i] == ' ') || (args.text[i] == '\t'))
+        {
+            name->length = i;
+            break;
+        }
+    }
+    int pos = name->length;
+    while ((pos < args.length) && ((args.text[pos] == ' ') || (args.text[pos] == '\t')))
+    {
+        pos++;
+    }
+    *value = { args.text + pos, args.length - pos };
+}
+
+void define_constant(assembler *as, text_view name, int value, unsigned char *bytes)
+{
+    if (value == INVALID_ADDRESS)
+    {
+        // the value marks undefined symbols, it's defined as 0 so uses don't report again
+        report(as, "Value out of range: %.*s\n", name.length, name.text);
+        value = 0;
+    }
+    if (set_symbol(as, &as->defines, name, value))
+    {
+        resolve_fixups(as, name.text, name.length, bytes);
+    }
+    else
+    {
+        report(as, "Duplicate define: %.*s\n", name.length, name.text);
+    }
+}
+
+// the constant is defined once every symbol of its value is
+void translate_define(assembler *as, text_view args, int pc, unsigned char *bytes)
+{
+    text_view name, value_text;
+    split_define(args, &name, &value_text);
+    expr e;
+    int value;
+    text_view missing;
+    if (eval_field(as, value_text, pc, &e, &value, &missing))
+    {
+        define_constant(as, name, value, bytes);
+    }
+    else
+    {
+        add_fixup(as, e.text, e.ops, e.count, missing, pc, fixup_define, name);
+    }
+}
+
+// length bytes at CPU address land inside the output image
+bool image_fits(assembler *as, int address, int length)
+{
+    long long image = (long long)address + as->image_delta;
+    return (image >= 0) && (image + length <= IMAGE_SIZE);
+}
+
+// comma separated byte expressions at address
+int translate_dcb(assembler *as, text_view args, int address, unsigned char *bytes)
+{
+    const char *c = args.text;
+    const char *end = args.text + args.length;
+    int length = 0;
+    expr e;
+
+    for (;;)
+    {
+        while ((c < end) && ((*c == ' ') || (*c == '\t')))
+        {
+            c++;
+        }
+        if (c >= end)
+        {
+            break;
+        }
+
+        int used = compile_expr(c, (int)(end - c), &e);
+        if ((used < 0) || ((c + used < end) && (c[used] != ',')))
+        {
+            report(as, "Invalid expression: %.*s\n", args.length, args.text);
+            break;
+        }
+
+        if (!image_fits(as, address + length, 1))
+        {
+            report(as, "Data outside the output image: %.*s\n", args.length, args.text);
+            break;
+        }
+        int value;
+        text_view missing;
+        int image = address + as->image_delta + length;
+        if (eval_expr(as, e.text, e.ops, e.count, address + length, &value, &missing))
+        {
+            bytes[image] = value & 0xFF;
+        }
+        else
+        {
+            bytes[image] = 0;
+            add_fixup(as, e.text, e.ops, e.count, missing, address + length, fixup_data, {});
+        }
+        length++;
+
+        c += used;
+        if (c >= end)
+        {
+            break;
+        }
+        c++; // skip ','
+    }
+
+    return length;
+}
+
+// *= expression, which can't use forward references
+int translate_origin(assembler *as, text_view args, int offset)
+{
+    expr e;
+    int value;
+    text_view missing;
+    if (!eval_field(as, args, offset, &e, &value, &missing))
+    {
+        report(as, "Undefined symbol in origin: %.*s\n", missing.length, missing.text);
+        return offset;
+    }
+    if ((value + as->image_delta < 0) || (value + as->image_delta >= IMAGE_SIZE))
+    {
+        report(as, "Origin outside the bank: %.*s\n", args.length, args.text);
+        return offset;
+    }
+    return value;
+}
+
+// BANK number, window [, size]: code from here on is in that bank, which the CPU sees at
+// the window address. banks are size bytes apart in the output image (default 16 KB)
+int translate_bank(assembler *as, text_view args, int offset)
+{
+    int values[3] = { 0, 0, as->bank_size ? as->bank_size : 0x4000 };
+    int count = 0;
+    const char *c = args.text;
+    const char *end = args.text + args.length;
+    while ((c < end) && (count < 3))
+    {
+        expr e;
+        int used = compile_expr(c, (int)(end - c), &e);
+        text_view missing;
+        if ((used <= 0) || !eval_expr(as, e.text, e.ops, e.count, offset, &values[count], &missing))
+        {
+            report(as, "Invalid bank: %.*s\n", args.length, args.text);
+            return offset;
+        }
+        count++;
+        c += used;
+        while ((c < end) && ((*c == ',') || (*c == ' ') || (*c == '\t')))
+        {
+            c++;
+        }
+    }
+
+    int bank = values[0];
+    int window = values[1];
+    int size = values[2];
+    if ((count < 2) || (bank < 0) || (bank > 0xFF) || (size <= 0) || (window < 0) || (window + size > 0x10000) ||
+        ((long long)(bank + 1) * size > IMAGE_SIZE))
+    {
+        report(as, "Invalid bank: %.*s\n", args.length, args.text);
+        return offset;
+    }
+    as->bank = bank;
+    as->bank_size = size;
+    as->image_delta = bank * size - window;
+    as->window_start = window;
+    as->window_end = window + size;
+    as->window_reported = false;
+    return window;
+}
+
+void report_unresolved(assembler *as)
+{
+    for (int i = 0; i < as->unresolved.capacity; i++)
+    {
+        symbol *s = &as->unresolved.slots[i];
+        if (s->label && (s->offset >= 0))
+        {
+            report(as, "Undefined symbol: %.*s\n", s->length, s->label);
+        }
+    }
+}
+
+// the first layout pass keeps the last size chosen for each instruction, grow only from here on
+#define FREE_LAYOUT_PASSES 8
+#define MAX_LAYOUT_PASSES 32
+
+// size of the ordinal-th instruction in the previous pass, 0 if there is none
+int layout_min_length(assembler *as, int ordinal)
+{
+    return ((as->pass > FREE_LAYOUT_PASSES) && (ordinal < as->layout_count)) ? as->layout_sizes[ordinal] : 0;
+}
+
+// a pass only clears the bytes the previous one wrote, so work follows the size of the
+// program rather than of the address space
+void clear_segments(assembler *as, unsigned char *bytes)
+{
+    for (int i = 0; i < as->segment_count; i++)
+    {
+        memset(bytes + as->segments[i].start, 0, as->segments[i].length);
+    }
+    as->segment_count = 0;
+}
+
+// past the window the bytes would land in the next bank, and without BANK the CPU only
+// sees up to $FFFF. reported once per pass
+void check_window(assembler *as, int address, int length)
+{
+    if (as->window_reported || (length <= 0))
+    {
+        return;
+    }
+    if (as->window_end > 0)
+    {
+        if ((address < as->window_start) || (address + length > as->window_end))
+        {
+            report(as, "Code outside the window of bank $%02x at $%04x\n", as->bank, address);
+            as->window_reported = true;
+        }
+    }
+    else if ((address < 0) || (address + length > 0x10000))
+    {
+        report(as, "Code outside the 64 KB address space at $%04x\n", address);
+        as->window_reported = true;
+    }
+}
+
+// length bytes at CPU address in the current bank
+void add_segment(assembler *as, int address, int length)
+{
+    if (length <= 0)
+    {
+        return;
+    }
+    check_window(as, address, length);
+    int start = address + as->image_delta;
+    if (as->segment_count > 0)
+    {
+        segment *last = &as->segments[as->segment_count - 1];
+        if ((last->start + last->length == start) && (last->address + last->length == address))
+        {
+            last->length += length;
+            return;
+        }
+    }
+    if (as->segment_count == as->segment_capacity)
+    {
+        as->segment_capacity = as->segment_capacity ? as->segment_capacity * 2 : 16;
+        as->segments = (segment *)realloc(as->segments, as->segment_capacity * sizeof(segment));
+    }
+    as->segments[as->segment_count++] = { start, length, address, as->bank };
+}
+
+// code usually moves forward, so this is close to a single sweep
+void sort_segments(assembler *as)
+{
+    segment *segments = as->segments;
+    for (int i = 1; i < as->segment_count; i++)
+    {
+        segment s = segments[i];
+        int j = i;
+        while ((j > 0) && (segments[j - 1].start > s.start))
+        {
+            segments[j] = segments[j - 1];
+            j--;
+        }
+        segments[j] = s;
+    }
+
+    // adjacent ranges the CPU also sees adjacent become one. overlapping ones wrote the
+    // same bytes twice, they are reported and kept apart
+    int count = 0;
+    for (int i = 0; i < as->segment_count; i++)
+    {
+        segment *last = count ? &segments[count - 1] : 0;
+        if (last && (segments[i].start < last->start + last->length))
+        {
+            report(as, "Overlapping output in bank $%02x at $%04x\n", segments[i].bank, segments[i].address);
+            segments[count++] = segments[i];
+        }
+        else if (last && (segments[i].start == last->start + last->length) && (segments[i].address == last->address + last->length))
+        {
+            last->length += segments[i].length;
+        }
+        else
+        {
+            segments[count++] = segments[i];
+        }
+    }
+    as->segment_count = count;
+}
+
+// the image is not what the CPU sees at its addresses: banks, or a window that is not
+// where the bank is in the image
+bool segments_banked(assembler *as)
+{
+    for (int i = 0; i < as->segment_count; i++)
+    {
+        if (as->segments[i].start != as->segments[i].address)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// from the lowest populated image offset to the end of the highest, gaps included
+int segment_span(assembler *as, int *first)
+{
+    if (as->segment_count == 0)
+    {
+        *first = 0;
+        return 0;
+    }
+    *first = as->segments[0].start;
+    int end = 0;
+    for (int i = 0; i < as->segment_count; i++)
+    {
+        int segment_end = as->segments[i].start + as->segments[i].length;
+        end = (segment_end > end) ? segment_end : end;
+    }
+    return end - *first;
+}
+
+int edit_kind(assembler *as, int ordinal)
+{
+    return (ordinal < as->edit_count) ? as->edits[ordinal].kind : edit_none;
+}
+
+void record_code(assembler *as, int ordinal, int address, int length, text_view args)
+{
+    if (as->code_count == as->code_capacity)
+    {
+        as->code_capacity = as->code_capacity ? as->code_capacity * 2 : 1024;
+        as->code = (code_line *)realloc(as->code, as->code_capacity * sizeof(code_line));
+    }
+    code_line *line = &as->code[as->code_count++];
+    line->ordinal = ordinal;
+    line->address = address;
+    line->image = address + as->image_delta;
+    line->length = length;
+    line->entry = as->code_entry;
+    line->args = args;
+    as->code_entry = false;
+}
+
+void record_layout(assembler *as, int ordinal, int length)
+{
+    if (ordinal >= as->layout_capacity)
+    {
+        as->layout_capacity = as->layout_capacity ? as->layout_capacity * 2 : 1024;
+        as->layout_sizes = (unsigned char *)realloc(as->layout_sizes, as->layout_capacity);
+    }
+    as->layout_sizes[ordinal] = (unsigned char)length;
+    if (ordinal >= as->layout_count)
+    {
+        as->layout_count = ordinal + 1;
+    }
+}
+
+// 64 bit FNV-1a
+unsigned long long hash_bytes(const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned long long hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ p[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// the same lines translate_pass would parse, up to the first 0 byte
+token_line *tokenize_source(const char *text, int size, int *line_count)
+{
+    int capacity = 256;
+    token_line *lines = (token_line *)malloc(capacity * sizeof(token_line));
+    int count = 0;
+    const char *c = text;
+    const char *end = text + size;
+    parsed_line parsed;
+    while (c < end)
+    {
+        const char *line = c;
+        while ((c < end) && (*c != '\n') && (*c != '\r') && (*c != 0))
+        {
+            c++;
+        }
+        int length = (int)(c - line);
+
+        if (length > 0)
+        {
+            parse_line(line, length, &parsed);
+            if ((parsed.label.length > 0) || (parsed.op.length > 0))
+            {
+                if (count == capacity)
+                {
+                    capacity *= 2;
+                    lines = (token_line *)realloc(lines, capacity * sizeof(token_line));
+                }
+                lines[count++] = { (int)(parsed.label.text - text), parsed.label.length, (int)(parsed.op.text - text), parsed.op.length,
+                    (int)(parsed.args.text - text), parsed.args.length };
+            }
+        }
+        if ((c < end) && (*c == 0))
+        {
+            break;
+        }
+        c++;
+    }
+    *line_count = count;
+    return lines;
+}
+
+// "../disasm/<hash of the path>.tok"
+void token_cache_name(const char *path, char (&name)[100])
+{
+    unsigned long long hash = hash_bytes(path, strlen(path));
+    strcpy_s(name, sizeof(name), "../disasm/");
+    char *p = name + strlen(name);
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        p = put_hex_byte(p, (unsigned int)(hash >> shift));
+    }
+    strcpy_s(p, sizeof(name) - (p - name), ".tok");
+}
+
+inline bool token_line_valid(const token_line *t, long long size)
+{
+    return (t->label >= 0) && (t->label_length >= 0) && (t->label + (long long)t->label_length <= size) &&
+        (t->op >= 0) && (t->op_length >= 0) && (t->op + (long long)t->op_length <= size) &&
+        (t->args >= 0) && (t->args_length >= 0) && (t->args + (long long)t->args_length <= size);
+}
+
+// fields can go backwards when one is empty, so the distances are zigzag encoded
+inline unsigned char *put_varint(unsigned char *p, int value)
+{
+    unsigned int v = ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+    while (v >= 0x80)
+    {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+inline const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, int *value)
+{
+    unsigned int v = 0;
+    for (int shift = 0; (p < end) && (shift < 35); shift += 7)
+    {
+        unsigned char b = *p++;
+        v |= (unsigned int)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+        {
+            *value = (int)(v >> 1) ^ -(int)(v & 1);
+            return p;
+        }
+    }
+    return 0;
+}
+
+// the cached token lines if the cache file matches key and path, 0 otherwise
+token_line *load_token_cache(const char *path, const token_cache_header *key, int *line_count)
+{
+    char name[100];
+    token_cache_name(path, name);
+    input_file cache;
+    if (!open_input(name, &cache))
+    {
+        return 0;
+    }
+
+    token_cache_header header;
+    token_line *lines = 0;
+    const unsigned char *p = cache.data + sizeof(header);
+    const unsigned char *end = cache.data + cache.size;
+    if (cache.size >= (int)sizeof(header))
+    {
+        memcpy(&header, cache.data, sizeof(header));
+    }
+    if ((cache.size >= (int)sizeof(header)) && (header.magic == key->magic) && (header.version == key->version) &&
+        (header.size == key->size) && (header.stamp == key->stamp) && (header.path_length == key->path_length) &&
+        (header.line_count >= 0) && (header.line_count <= key->size) && (header.token_bytes >= 0) &&
+        (end - p == (long long)header.path_length + header.token_bytes) && (memcmp(p, path, header.path_length) == 0))
+    {
+        p += header.path_length;
+        lines = (token_line *)malloc((header.line_count + 1) * sizeof(token_line));
+        int position = 0;
+        for (int i = 0; p && (i < header.line_count); i++)
+        {
+            token_line *t = &lines[i];
+            int fields[6];
+            for (int k = 0; p && (k < 6); k++)
+            {
+                p = get_varint(p, end, &fields[k]);
+            }
+            if (!p)
+            {
+                break;
+            }
+            t->label = position + fields[0];
+            t->label_length = fields[1];
+            t->op = t->label + t->label_length + fields[2];
+            t->op_length = fields[3];
+            t->args = t->op + t->op_length + fields[4];
+            t->args_length = fields[5];
+            position = t->args + t->args_length;
+            if (!token_line_valid(t, key->size))
+            {
+                p = 0;
+            }
+        }
+        if (p != end)
+        {
+            free(lines);
+            lines = 0;
+        }
+        *line_count = header.line_count;
+    }
+    close_input(&cache);
+    return lines;
+}
+
+// written next to the cache and renamed over it, so a reader never sees half a file
+void save_token_cache(const char *path, const token_cache_header *key, const token_line *lines, int line_count)
+{
+    unsigned char *tokens = (unsigned char *)malloc((size_t)line_count * 6 * 5 + 1);
+    unsigned char *p = tokens;
+    int position = 0;
+    for (int i = 0; i < line_count; i++)
+    {
+        const token_line *t = &lines[i];
+        p = put_varint(p, t->label - position);
+        p = put_varint(p, t->label_length);
+        p = put_varint(p, t->op - (t->label + t->label_length));
+        p = put_varint(p, t->op_length);
+        p = put_varint(p, t->args - (t->op + t->op_length));
+        p = put_varint(p, t->args_length);
+        position = t->args + t->args_length;
+    }
+
+    char name[100];
+    char temp[104];
+    token_cache_name(path, name);
+    strcpy_s(temp, sizeof(temp), name);
+    strcat_s(temp, ".new");
+    FILE *f;
+    fopen_s(&f, temp, "wb");
+    if (!f)
+    {
+        free(tokens);
+        return;
+    }
+    token_cache_header header = *key;
+    header.line_count = line_count;
+    header.token_bytes = (int)(p - tokens);
+    bool ok = (fwrite(&header, sizeof(header), 1, f) == 1) && (fwrite(path, 1, header.path_length, f) == (size_t)header.path_length) &&
+        (fwrite(tokens, 1, header.token_bytes, f) == (size_t)header.token_bytes);
+    ok = (fclose(f) == 0) && ok;
+#ifdef _WIN32
+    ok = ok && MoveFileExA(temp, name, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && (rename(temp, name) == 0);
+#endif
+    if (!ok)
+    {
+        remove(temp);
+    }
+    free(tokens);
+}
+
+// the name of an INCLUDE, relative to the directory of the file including it
+void include_path(text_view args, const char *from, char (&path)[260])
+{
+    const char *name = args.text;
+    int length = args.length;
+    while ((length > 0) && ((name[length - 1] == ' ') || (name[length - 1] == '\t')))
+    {
+        length--;
+    }
+    if ((length >= 2) && ((name[0] == '"') || (name[0] == '\'')) && (name[length - 1] == name[0]))
+    {
+        name++;
+        length -= 2;
+    }
+
+    int dir_length = 0;
+    bool absolute = (length > 0) && ((name[0] == '/') || (name[0] == '\\') || ((length > 1) && (name[1] == ':')));
+    for (int i = 0; from && !absolute && from[i]; i++)
+    {
+        if ((from[i] == '/') || (from[i] == '\\'))
+        {
+            dir_length = i + 1;
+        }
+    }
+    if (dir_length + length >= (int)sizeof(path))
+    {
+        path[0] = 0;
+        return;
+    }
+    if (dir_length > 0)
+    {
+        memcpy(path, from, dir_length);
+    }
+    memcpy(path + dir_length, name, length);
+    path[dir_length + length] = 0;
+}
+
+// the file of an INCLUDE line, read and tokenized by the first pass that gets to it
+source_file *include_source(assembler *as, text_view args, const char *from)
+{
+    char path[260];
+    include_path(args, from, path);
+    bool cycle = as->source_name && (strcmp(as->source_name, path) == 0);
+    for (int i = 0; !cycle && (i < as->include_depth); i++)
+    {
+        cycle = (strcmp(as->include_stack[i], path) == 0);
+    }
+    if (cycle)
+    {
+        report(as, "Circular include: %s\n", path);
+        return 0;
+    }
+    if (as->include_depth >= MAX_INCLUDE_DEPTH)
+    {
+        report(as, "Includes nested too deeply: %s\n", path);
+        return 0;
+    }
+    for (int i = 0; i < as->source_count; i++)
+    {
+        if (strcmp(as->sources[i].path, path) == 0)
+        {
+            return &as->sources[i];
+        }
+    }
+
+    long long stamp, size;
+    input_file in;
+    if (!path[0] || !file_stamp(path, &stamp, &size) || !open_input(path, &in))
+    {
+        report(as, "Error opening include file: %.*s\n", args.length, args.text);
+        return 0;
+    }
+
+    token_cache_header key = {};
+    key.magic = TOKEN_CACHE_MAGIC;
+    key.version = TOKEN_CACHE_VERSION;
+    key.size = in.size;
+    key.stamp = stamp;
+    key.path_length = (int)strlen(path);
+
+    source_file source = {};
+    source.in = in;
+    source.lines = load_token_cache(path, &key, &source.line_count);
+    if (!source.lines)
+    {
+        source.lines = tokenize_source((const char *)in.data, in.size, &source.line_count);
+        save_token_cache(path, &key, source.lines, source.line_count);
+    }
+    else if (as->stats)
+    {
+        as->stats->token_cache_hits++;
+    }
+    if (as->stats)
+    {
+        as->stats->includes++;
+    }
+    source.path = (char *)malloc(key.path_length + 1);
+    memcpy(source.path, path, key.path_length + 1);
+
+    if (as->source_count == as->source_capacity)
+    {
+        as->source_capacity = as->source_capacity ? as->source_capacity * 2 : 16;
+        as->sources = (source_file *)realloc(as->sources, as->source_capacity * sizeof(source_file));
+    }
+    as->sources[as->source_count] = source;
+    return &as->sources[as->source_count++];
+}
+
+// IMPORT "file.sym": the symbols another assembly wrote with -s. they are looked up in the
+// mapped file when a name is in neither of this assembly's tables, nothing is copied
+void import_symbols(assembler *as, text_view args, const char *from, unsigned char *bytes)
+{
+    char path[260];
+    include_path(args, from, path);
+    for (int i = 0; i < as->import_count; i++)
+    {
+        if (strcmp(as->imports[i].path, path) == 0)
+        {
+            return;
+        }
+    }
+
+    symbol_file import = {};
+    if (!path[0] || !open_input(path, &import.in))
+    {
+        report(as, "Error opening symbol file: %.*s\n", args.length, args.text);
+        return;
+    }
+    if (!symfile_valid(import.in.data, import.in.size))
+    {
+        report(as, "Invalid symbol file: %s\n", path);
+        close_input(&import.in);
+        return;
+    }
+    int path_length = (int)strlen(path);
+    import.path = (char *)malloc(path_length + 1);
+    memcpy(import.path, path, path_length + 1);
+    if (as->import_count == as->import_capacity)
+    {
+        as->import_capacity = as->import_capacity ? as->import_capacity * 2 : 4;
+        as->imports = (symbol_file *)realloc(as->imports, as->import_capacity * sizeof(symbol_file));
+    }
+    as->imports[as->import_count++] = import;
+
+    // references made before the IMPORT line. resolving can add to the unresolved table,
+    // so the names are collected first
+    text_view *pending = (text_view *)malloc((as->unresolved.count + 1) * sizeof(text_view));
+    int pending_count = 0;
+    for (int i = 0; i < as->unresolved.capacity; i++)
+    {
+        const symbol *s = &as->unresolved.slots[i];
+        if (s->label && (s->offset >= 0) && symfile_find(import.in.data, s->label, s->length))
+        {
+            pending[pending_count++] = { s->label, s->length };
+        }
+    }
+    for (int i = 0; i < pending_count; i++)
+    {
+        resolve_fixups(as, pending[i].text, pending[i].length, bytes);
+    }
+    free(pending);
+}
+
+// one line of the main file or of an included one
+void translate_line(assembler *as, const parsed_line *parsed, const char *file, int *offset, int *ordinal, unsigned char *bytes)
+{
+    asm_stats *stats = as->stats;
+    if (stats)
+    {
+        stats->lines++;
+    }
+    if (parsed->label.length > 0)
+    {
+        define_label(as, parsed->label, *offset, bytes);
+        as->code_entry = true;
+    }
+    if (view_equals(parsed->op, "DEFINE"))
+    {
+        translate_define(as, parsed->args, *offset, bytes);
+    }
+    else if (parsed->op.length > 0)
+    {
+        if (view_equals(parsed->op, "DCB"))
+        {
+            int dcb_length = translate_dcb(as, parsed->args, *offset, bytes);
+            add_segment(as, *offset, dcb_length);
+            as->code_entry = true;
+            if (stats)
+            {
+                stats->dcb_bytes += dcb_length;
+                stats->bytes_emitted += dcb_length;
+            }
+            *offset += dcb_length;
+        }
+        else if (parsed->op.text[0] == '*')
+        {
+            *offset = translate_origin(as, parsed->args, *offset);
+            as->code_entry = true;
+        }
+        else if (view_equals(parsed->op, "BANK"))
+        {
+            *offset = translate_bank(as, parsed->args, *offset);
+            as->code_entry = true;
+        }
+        else if (view_equals(parsed->op, "IMPORT"))
+        {
+            import_symbols(as, parsed->args, file, bytes);
+        }
+        else if (view_equals(parsed->op, "INCLUDE") || view_equals(parsed->op, "INCSRC"))
+        {
+            source_file *source = include_source(as, parsed->args, file);
+            if (source)
+            {
+                // the sources array can grow while the lines are assembled
+                const char *text = (const char *)source->in.data;
+                const char *path = source->path;
+                const token_line *lines = source->lines;
+                int line_count = source->line_count;
+                as->include_stack[as->include_depth++] = path;
+                for (int i = 0; i < line_count; i++)
+                {
+                    const token_line *t = &lines[i];
+                    parsed_line line = { { text + t->label, t->label_length }, { text + t->op, t->op_length }, { text + t->args, t->args_length } };
+                    translate_line(as, &line, path, offset, ordinal, bytes);
+                }
+                as->include_depth--;
+            }
+        }
+        else if (edit_kind(as, *ordinal) == edit_drop)
+        {
+            // its label now belongs to the next instruction
+            record_layout(as, (*ordinal)++, 0);
+        }
+        else if (!image_fits(as, *offset, 5)) // room for the longest encoding, a long branch
+        {
+            report(as, "Code outside the output image: %.*s %.*s\n", parsed->op.length, parsed->op.text, parsed->args.length, parsed->args.text);
+            record_layout(as, (*ordinal)++, 0);
+        }
+        else
+        {
+            text_view op = parsed->op;
+            text_view args = parsed->args;
+            int kind = edit_kind(as, *ordinal);
+            if ((kind == edit_jmp) || (kind == edit_jmp_target))
+            {
+                op = { "JMP", 3 };
+            }
+            if ((kind == edit_target) || (kind == edit_jmp_target))
+            {
+                args = as->edits[*ordinal].target;
+            }
+            int address = 0;
+            operand_ref ref;
+            address_mode mode = get_address_mode(as, args, *offset, &address, &ref);
+            int probes = 0;
+            int op_length = translate_instruction(op, mode, *offset, address, layout_min_length(as, *ordinal), bytes + (*offset + as->image_delta),
+                stats ? &probes : 0);
+            if (as->optimize)
+            {
+                record_code(as, *ordinal, *offset, op_length, args);
+            }
+            record_layout(as, (*ordinal)++, op_length);
+            add_segment(as, *offset, op_length);
+            if ((op_length > 1) && !ref.defined && (as->pass == 1))
+            {
+                add_fixup(as, ref.value.text, ref.value.ops, ref.value.count, ref.missing, *offset, instruction_fixup(bytes[*offset + as->image_delta]), {});
+                if (stats)
+                {
+                    stats->fixups++;
+                }
+            }
+            if (stats)
+            {
+                stats->instructions++;
+                stats->opcode_probes += probes;
+                stats->bytes_emitted += op_length;
+            }
+            *offset += op_length;
+        }
+    }
+}
+
+int translate_pass(assembler *as, const char *program, unsigned char *bytes, int size, int base_address)
+{
+    const char *c = program;
+    const char *end = program + size;
+    parsed_line parsed;
+    int offset = base_address;
+    int ordinal = 0;
+    asm_stats *stats = as->stats;
+    double t0 = stats ? get_seconds() : 0;
+    if (stats)
+    {
+        // these describe the program, so they are counted by the last pass only
+        stats->lines = 0;
+        stats->instructions = 0;
+        stats->opcode_probes = 0;
+        stats->bytes_emitted = 0;
+        stats->dcb_bytes = 0;
+    }
+    as->code_count = 0;
+    as->code_entry = true;
+    as->bank = 0;
+    as->image_delta = 0;
+    as->window_start = 0;
+    as->window_end = 0;
+    as->window_reported = false;
+    clear_segments(as, bytes);
+    while (c < end)
+    {
+        const char *line = c;
+        while ((c < end) && (*c != '\n') && (*c != '\r') && (*c != 0))
+        {
+            c++;
+        }
+        int length = (int)(c - line);
+
+        if (length > 0)
+        {
+            parse_line(line, length, &parsed);
+            translate_line(as, &parsed, as->source_name, &offset, &ordinal, bytes);
+        }
+        if ((c < end) && (*c == 0))
+        {
+            break;
+        }
+        c++;
+    }
+
+    sort_segments(as);
+    double t1 = stats ? get_seconds() : 0;
+    if (as->pass == 1)
+    {
+        report_unresolved(as);
+    }
+    if (stats)
+    {
+        stats->passes++;
+        stats->translate_seconds += t1 - t0;
+        stats->unresolved_seconds += get_seconds() - t1;
+    }
+
+    return offset - base_address;
+}
+
+// the first pass emits bytes immediately and patches forward references through fixups,
+// assuming absolute operands and short branches. when that guess turns out wrong (a forward
+// zero page symbol, a branch out of range) the program is translated again with every
+// symbol known from the previous pass until no symbol moves
+int translate_program(assembler *as, const char *program, unsigned char *bytes, int size, int base_address)
+{
+    as->pass = 1;
+    as->layout_changed = false;
+    int length = translate_pass(as, program, bytes, size, base_address);
+
+    bool quiet = as->quiet;
+    as->quiet = true;
+    while (as->layout_changed && (as->pass < MAX_LAYOUT_PASSES))
+    {
+        as->pass++;
+        as->layout_changed = false;
+        free_fixups(as);
+        length = translate_pass(as, program, bytes, size, base_address);
+    }
+    as->quiet = quiet;
+
+    if (as->layout_changed)
+    {
+        report(as, "Layout did not converge after %d passes\n", as->pass);
+    }
+    return length;
+}
+
+// flags as bits of a mask, for the liveness test of the peephole rules
+#define FLAG_C 1
+#define FLAG_Z 2
+#define FLAG_V 4
+#define FLAG_N 8
+#define FLAGS_ALL 15
+
+// flags an instruction reads and writes. false if control can leave straight line code,
+// everything is then assumed to be read
+bool flag_effects(int id, int *read, int *written)
+{
+    *read = 0;
+    *written = 0;
+#define _op(mnemonic) mnemonic_key(mnemonic, 3)
+    switch (mnemonic_key(opcodes[id].mnemonic, 3))
+    {
+        case _op("ADC"): case _op("SBC"):
+            *read = FLAG_C;
+            *written = FLAGS_ALL;
+            break;
+        case _op("ROL"): case _op("ROR"):
+            *read = FLAG_C;
+            *written = FLAG_N | FLAG_Z | FLAG_C;
+            break;
+        case _op("ASL"): case _op("LSR"): case _op("CMP"): case _op("CPX"): case _op("CPY"):
+            *written = FLAG_N | FLAG_Z | FLAG_C;
+            break;
+        case _op("BIT"):
+            *written = FLAG_N | FLAG_Z | FLAG_V;
+            break;
+        case _op("LDA"): case _op("LDX"): case _op("LDY"): case _op("AND"): case _op("ORA"): case _op("EOR"):
+        case _op("TAX"): case _op("TAY"): case _op("TXA"): case _op("TYA"): case _op("TSX"): case _op("PLA"):
+        case _op("INC"): case _op("DEC"): case _op("INX"): case _op("INY"): case _op("DEX"): case _op("DEY"):
+            *written = FLAG_N | FLAG_Z;
+            break;
+        case _op("CLC"): case _op("SEC"):
+            *written = FLAG_C;
+            break;
+        case _op("CLV"):
+            *written = FLAG_V;
+            break;
+        case _op("PLP"):
+            *written = FLAGS_ALL;
+            break;
+        case _op("PHP"):
+            *read = FLAGS_ALL;
+            break;
+        case _op("STA"): case _op("STX"): case _op("STY"): case _op("TXS"): case _op("PHA"): case _op("NOP"):
+        case _op("CLI"): case _op("SEI"): case _op("CLD"): case _op("SED"):
+            break;
+        default:
+            // branches, jumps, returns, BRK and undocumented bytes
+            *read = FLAGS_ALL;
+            return false;
+    }
+    return true;
+}
+
+// the instruction leaves N and Z set from the register ('A', 'X' or 'Y') it writes
+bool sets_nz_of(int id, char reg)
+{
+    switch (mnemonic_key(opcodes[id].mnemonic, 3))
+    {
+        case _op("LDA"): case _op("ADC"): case _op("SBC"): case _op("AND"): case _op("ORA"): case _op("EOR"):
+        case _op("TXA"): case _op("TYA"): case _op("PLA"):
+            return reg == 'A';
+        case _op("LDX"): case _op("TAX"): case _op("TSX"): case _op("INX"): case _op("DEX"):
+            return reg == 'X';
+        case _op("LDY"): case _op("TAY"): case _op("INY"): case _op("DEY"):
+            return reg == 'Y';
+        default:
+            return false;
+    }
+#undef _op
+}
+
+// code[index] falls through to the next instruction
+bool falls_into(assembler *as, int index)
+{
+    const code_line *line = &as->code[index];
+    return (index + 1 < as->code_count) && (line->address + line->length == line[1].address) && (line->image + line->length == line[1].image);
+}
+
+// true if no flag in mask is read before it is written again, following straight line
+// code after code[index]. the instructions looked at are pinned: removing one of them in
+// the same round could remove a write this relies on
+bool flags_dead(assembler *as, const unsigned char *bytes, int index, int mask, bool *pinned)
+{
+    for (int i = index; falls_into(as, i); i++)
+    {
+        code_line *line = &as->code[i + 1];
+        pinned[i + 1] = true;
+        if (edit_kind(as, line->ordinal) == edit_drop)
+        {
+            continue;
+        }
+        int read, written;
+        if (!flag_effects(bytes[line->image], &read, &written) || (read & mask))
+        {
+            return false;
+        }
+        mask &= ~written;
+        if (mask == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void add_edit(assembler *as, int ordinal, int kind, text_view target)
+{
+    as->edits[ordinal].kind = kind;
+    as->edits[ordinal].target = target;
+}
+
+void count_rewrite(assembler *as, peephole_rule rule, int bytes, int cycles)
+{
+    as->saved.rewrites[rule]++;
+    as->saved.bytes += bytes;
+    as->saved.cycles += cycles;
+}
+
+// one sweep of the rules over the code of the last pass, none of them crosses an entry
+// point. assumes operands are plain memory (reading back a store gives the stored value),
+// and that subroutines do not look at their return address. returns true if anything
+// was rewritten
+bool peephole_round(assembler *as, const unsigned char *bytes)
+{
+    if (as->edit_count < as->layout_count)
+    {
+        as->edits = (peephole_edit *)realloc(as->edits, as->layout_count * sizeof(peephole_edit));
+        memset(as->edits + as->edit_count, 0, (as->layout_count - as->edit_count) * sizeof(peephole_edit));
+        as->edit_count = as->layout_count;
+    }
+
+    // ADC #0 is not a no-op in decimal mode
+    bool decimal = false;
+    int *at = (int *)malloc(0x10000 * sizeof(int));
+    memset(at, 0xFF, 0x10000 * sizeof(int));
+    for (int i = 0; i < as->code_count; i++)
+    {
+        int id = bytes[as->code[i].image];
+        decimal |= (id == 0xF8) || (id == 0x28) || (id == OP_RTI); // SED, PLP
+        at[as->code[i].address] = i; // banks sharing a window are told apart below
+    }
+
+    // targets written as loop+2 or *+n have no label, the decoded branches and jumps find them
+    for (int i = 0; i < as->code_count; i++)
+    {
+        const code_line *line = &as->code[i];
+        const unsigned char *b = bytes + line->image;
+        int target = -1;
+        if ((opcodes[b[0]].mode == address_mode_rel) && (line->length == 2))
+        {
+            target = (line->address + 2 + (signed char)b[1]) & 0xFFFF;
+        }
+        else if ((opcodes[b[0]].mode == address_mode_rel) && (line->length == 5))
+        {
+            target = b[3] | (b[4] << 8); // long branch: the JMP it skips over
+        }
+        else if ((b[0] == OP_JMP) || (b[0] == OP_JSR))
+        {
+            target = b[1] | (b[2] << 8);
+        }
+        int j = (target >= 0) ? at[target] : -1;
+        if ((j >= 0) && (as->code[j].image - as->code[j].address == line->image - line->address))
+        {
+            as->code[j].entry = true;
+        }
+    }
+
+    bool *pinned = (bool *)calloc(as->code_count + 1, sizeof(bool));
+    bool changed = false;
+    for (int i = 0; i < as->code_count; i++)
+    {
+        code_line *line = &as->code[i];
+        const unsigned char *b = bytes + line->image;
+        const opcode *op = &opcodes[b[0]];
+        code_line *next = falls_into(as, i) ? &as->code[i + 1] : 0;
+        bool next_free = next && !next->entry && !pinned[i + 1];
+        const opcode *next_op = next ? &opcodes[bytes[next->image]] : 0;
+
+        // STA m / LDA m: the load is dropped if N and Z already reflect the register
+        if (next_free && (op->mnemonic[0] == 'S') && (op->mnemonic[1] == 'T') && (next_op->mnemonic[0] == 'L') &&
+            (next_op->mnemonic[1] == 'D') && (next_op->mnemonic[2] == op->mnemonic[2]) && (next_op->mode == op->mode) &&
+            (memcmp(b + 1, bytes + next->image + 1, op->length - 1) == 0))
+        {
+            char reg = op->mnemonic[2];
+            code_line *prev = (i > 0) ? &as->code[i - 1] : 0;
+            bool nz = !line->entry && prev && falls_into(as, i - 1) && (edit_kind(as, prev->ordinal) != edit_drop) &&
+                sets_nz_of(bytes[prev->image], reg);
+            if (nz)
+            {
+                pinned[i - 1] = true;
+            }
+            if (nz || flags_dead(as, bytes, i + 1, FLAG_N | FLAG_Z, pinned))
+            {
+                add_edit(as, next->ordinal, edit_drop, {});
+                count_rewrite(as, rule_redundant_load, next_op->length, next_op->cycles);
+                changed = true;
+                i++;
+                continue;
+            }
+        }
+
+        // CLC / ADC #0 and SEC / SBC #0 only change flags
+        if (next_free && !decimal && !pinned[i] && (((b[0] == 0x18) && (bytes[next->image] == 0x69)) ||
+            ((b[0] == 0x38) && (bytes[next->image] == 0xE9))) && (bytes[next->image + 1] == 0) &&
+            flags_dead(as, bytes, i + 1, FLAGS_ALL, pinned))
+        {
+            add_edit(as, line->ordinal, edit_drop, {});
+            add_edit(as, next->ordinal, edit_drop, {});
+            count_rewrite(as, rule_carry_add, op->length + next_op->length, op->cycles + next_op->cycles);
+            changed = true;
+            i++;
+            continue;
+        }
+
+        // JSR sub / RTS: the subroutine returns for us. the RTS stays if something else jumps to it
+        if ((b[0] == OP_JSR) && next && (bytes[next->image] == OP_RTS))
+        {
+            add_edit(as, line->ordinal, edit_jmp, {});
+            int saved_bytes = 0;
+            if (next_free)
+            {
+                add_edit(as, next->ordinal, edit_drop, {});
+                saved_bytes = next_op->length;
+                i++;
+            }
+            count_rewrite(as, rule_tail_call, saved_bytes, op->cycles + next_op->cycles - opcodes[OP_JMP].cycles);
+            changed = true;
+            continue;
+        }
+
+        // a branch or JMP to a JMP goes to the final target directly. long branches are left
+        // alone, and so are targets whose expression depends on where it is evaluated
+        int target = -1;
+        if ((op->mode == address_mode_rel) && (line->length == 2))
+        {
+            target = (line->address + 2 + (signed char)b[1]) & 0xFFFF;
+        }
+        else if (b[0] == OP_JMP)
+        {
+            target = b[1] | (b[2] << 8);
+        }
+        int j = (target >= 0) ? at[target] : -1;
+        if ((j >= 0) && (as->code[j].image - as->code[j].address != line->image - line->address))
+        {
+            j = -1;
+        }
+        if ((j >= 0) && (j != i) && (bytes[as->code[j].image] == OP_JMP) && !memchr(as->code[j].args.text, '*', as->code[j].args.length))
+        {
+            int final_target = bytes[as->code[j].image + 1] | (bytes[as->code[j].image + 2] << 8);
+            int distance = final_target - line->address - 2;
+            if ((final_target != target) && ((b[0] == OP_JMP) || ((distance >= -128) && (distance <= 127))))
+            {
+                // a JSR turned into a JMP by an earlier round stays one, its RTS is gone
+                int kind = (edit_kind(as, line->ordinal) == edit_jmp) ? edit_jmp_target : edit_target;
+                add_edit(as, line->ordinal, kind, as->code[j].args);
+                count_rewrite(as, rule_jump_chain, 0, opcodes[OP_JMP].cycles);
+                changed = true;
+            }
+        }
+    }
+
+    free(pinned);
+    free(at);
+    return changed;
+}
+
+#define MAX_PEEPHOLE_ROUNDS 16
+
+// assembles, applies the peephole rules to the result, and assembles again until no
+// rule matches
+int optimize_program(assembler *as, const char *program, unsigned char *bytes, int size, int base_address)
+{
+    as->saved = {};
+    as->edit_count = 0;
+    int length = translate_program(as, program, bytes, size, base_address);
+
+    // errors were reported by the first assembly, and the stats are about it
+    asm_stats *stats = as->stats;
+    as->stats = 0;
+    as->quiet = true;
+    for (int round = 0; (round < MAX_PEEPHOLE_ROUNDS) && peephole_round(as, bytes); round++)
+    {
+        int edit_count = as->edit_count;
+        assembler_reset(as);
+        as->edit_count = edit_count;
+        length = translate_program(as, program, bytes, size, base_address);
+    }
+    as->quiet = false;
+    as->stats = stats;
+    return length;
+}
+
+void print_peephole(assembler *as)
+{
+    const peephole_stats *s = &as->saved;
+    report(as, "Optimized: %d redundant loads, %d carry adds, %d tail calls, %d jump chains; %d bytes and %d cycles saved\n",
+        s->rewrites[rule_redundant_load], s->rewrites[rule_carry_add], s->rewrites[rule_tail_call], s->rewrites[rule_jump_chain],
+        s->bytes, s->cycles);
+}
+
+int asm_program(assembler *as, const char *program, unsigned char *bytes, int size, int base_address)
+{
+    free_sources(as);
+    int byte_size = as->optimize ? optimize_program(as, program, bytes, size, base_address) : translate_program(as, program, bytes, size, base_address);
+#if 0
+    printf("\nDEFINES\n=======\n");
+    print_symbols(&as->defines);
+    printf("\nLABELS\n=======\n");
+    print_symbols(&as->labels);
+    printf("\n");
+    print_symbol_stats(&as->defines, "defines");
+    print_symbol_stats(&as->labels, "labels");
+#endif
+    return byte_size;
+}
+
+void asm_test()
+{
+#if 1
+    const char *program =
+        "; static noise\n"
+        "\n"
+        "define symbol 123\n"
+        "start: ldy #$ff\n\r"
+        "       ldx\t#$0\n"
+        "loop:  lda $fe\n"
+        "   \t    sta $200  ,  x\n"
+        "       and #$7\n"
+        "define another $123\n"
+        "       sta $300, x\r"
+        "       and #$3\n"
+        "       sta $400 ,x\n"
+        "      and   #$1\n"
+        "       sta $500,x\n"
+        "       inx\n"
+        "       dey\n"
+        "       bne loop\n"
+        "       rts\n"
+        "*=512\n"
+        "offset512:"
+        "*=$400\n"
+        "offsetx400:"
+        //"label: dcb 12,34,56"
+        ;
+#else
+    const char *program =
+        "XXX #$FFFF\n"
+        "XXX #9999\n"
+        "XXX #<label\n"
+        "XXX #>label\n"
+        "XXX #symbol\n"
+        "XXX $FFFF\n"
+        "XXX $0,x \n"
+        "XXX $FFFF ,x\n"
+        "XXX $FFFF,y\n"
+        "XXX ($0 ),y\n"
+        "XXX ($0,x)\n"
+        "XXX (label ) , y\n"
+        "XXX (label , x)\n"
+        "XXX 9999\n"
+        "XXX label\n"
+        "XXX label,x\n"
+        "XXX label,y\n"
+        "XXX a\n";
+
+#endif
+    assembler as;
+    assembler_init(&as, 0);
+    int size = asm_program(&as, program, as.out_data, (int)strlen(program), 0x600);
+    disasm_program(as.out_data + 0x600, size, 0x600, stdout);
+    assembler_free(&as);
+}
+
+// --check: programs the peephole optimizer once got wrong. each one is run with and without
+// -O and has to end with the same registers
+
+struct peephole_case
+{
+    const char *name;
+    const char *program;
+};
+
+const peephole_case peephole_cases[] =
+{
+    { "tail call into a jump chain", "  JSR sub\n  RTS\n  LDX #$EE\n  BRK\nsub: JMP other\nother: INX\n  RTS\n" },
+    { "unlabelled branch target", "  LDX #2\n  LDA #0\nloop: STA $10\n  LDA $10\n  CLC\n  ADC #1\n  DEX\n  BNE loop+2\n  BRK\n" },
+};
+
+// assembles program at $0600 and runs it from there until BRK
+cpu run_check_program(const char *program, bool optimize)
+{
+    assembler as;
+    assembler_init(&as, 0);
+    as.quiet = true;
+    as.optimize = optimize;
+    asm_program(&as, program, as.out_data, (int)strlen(program), 0x600);
+    unsigned char *memory = (unsigned char *)calloc(OUT_BUFFER_SIZE, 1);
+    for (int i = 0; i < as.segment_count; i++)
+    {
+        segment *s = &as.segments[i];
+        if ((s->bank == 0) && (s->address + s->length <= OUT_BUFFER_SIZE))
+        {
+            memcpy(memory + s->address, as.out_data + s->start, s->length);
+        }
+    }
+    cpu c;
+    cpu_reset(&c, memory, 0x600);
+    cpu_run(&c, 100000);
+    c.memory = 0;
+    free(memory);
+    assembler_free(&as);
+    return c;
+}
+
+int check_suite()
+{
+    int failed = 0;
+    for (const peephole_case &t : peephole_cases)
+    {
+        cpu plain = run_check_program(t.program, false);
+        cpu optimized = run_check_program(t.program, true);
+        bool same = (plain.stop == optimized.stop) && (plain.pc == optimized.pc) && (plain.a == optimized.a) &&
+            (plain.x == optimized.x) && (plain.y == optimized.y);
+        printf("%s  %s\n", same ? "ok    " : "FAILED", t.name);
+        if (!same)
+        {
+            printf("        A=$%02x X=$%02x Y=$%02x without -O, A=$%02x X=$%02x Y=$%02x with -O\n",
+                plain.a, plain.x, plain.y, optimized.a, optimized.x, optimized.y);
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
+
+// benchmark suite (--bench): deterministic synthetic workloads, each phase timed on its own
+// results are printed as JSON so runs from different commits can be compared
+
+unsigned int bench_random(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+void bench_emit(output_buffer *src, int *lines, const char *format, ...)
+{
+    char line[128];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    output_write(src, line, length);
+    (*lines)++;
+}
+
+// blocks of defines, labels, a loop, forward branches/jumps/calls and DCB data
+// the origin is reset every 256 blocks so the image stays inside the 64K output buffer
+int bench_source(output_buffer *src, int target_lines, unsigned int seed)
+{
+    static const char *fillers[] =
+    {
+        "        adc #$%02x\n",
+        "        and $%02x\n",
+        "        ora $03%02x,x\n",
+        "        eor ($%02x,x)\n",
+        "        inc $02%02x\n",
+        "        asl a\n",
+        "        lsr\n",
+        "        clc\n",
+        "        sec\n",
+        "; filler %d\n",
+    };
+    int filler_count = (int)(sizeof(fillers) / sizeof(fillers[0]));
+
+    int lines = 0;
+    for (int k = 0; lines < target_lines; k++)
+    {
+        if ((k % 256) == 0)
+        {
+            bench_emit(src, &lines, "*=$0600\n");
+        }
+        bench_emit(src, &lines, "define c%d $%02x\n", k, 0x10 + bench_random(&seed) % 0xE0);
+        bench_emit(src, &lines, "define w%d $%04x\n", k, 0x0200 + bench_random(&seed) % 0x7E00);
+        bench_emit(src, &lines, "b%d:     ldx #$%02x\n", k, bench_random(&seed) & 0xFF);
+        bench_emit(src, &lines, "l%d:     lda c%d,x\n", k, k);
+        int filler_lines = bench_random(&seed) % 7;
+        for (int i = 0; i < filler_lines; i++)
+        {
+            int value = bench_random(&seed);
+            bench_emit(src, &lines, fillers[value % filler_count], (value >> 4) & 0xFF);
+        }
+        if (k > 0)
+        {
+            bench_emit(src, &lines, "        ldy #<b%d\n", k - 1);
+            bench_emit(src, &lines, "        sbc c%d,x\n", k - 1);
+        }
+        bench_emit(src, &lines, "        cmp w%d\n", k);
+        bench_emit(src, &lines, "        beq f%d\n", k);
+        bench_emit(src, &lines, "        sta w%d,y\n", k);
+        bench_emit(src, &lines, "        dex\n");
+        bench_emit(src, &lines, "        bne l%d\n", k);
+        bench_emit(src, &lines, "        jsr s%d\n", k);
+        bench_emit(src, &lines, "        jmp n%d\n", k);
+        bench_emit(src, &lines, "f%d:     lda (c%d),y\n", k, k);
+        bench_emit(src, &lines, "        dcb $%02x,$%02x,$%02x,$%02x\n", bench_random(&seed) & 0xFF, bench_random(&seed) & 0xFF,
+            bench_random(&seed) & 0xFF, bench_random(&seed) & 0xFF);
+        bench_emit(src, &lines, "s%d:     rts\n", k);
+        bench_emit(src, &lines, "n%d:     nop\n", k);
+    }
+    return lines;
+}
+
+// instruction stream with the opcode mix and operand ranges of ordinary code
+void bench_code_binary(unsigned char *bytes, int size, unsigned int seed)
+{
+    int offset = 0;
+    while (offset < size)
+    {
+        const opcode_def *def = &opcode_defs[bench_random(&seed) % OPCODE_DEF_COUNT];
+        int value = bench_random(&seed);
+        if (def->mode == address_mode_rel)
+        {
+            value = (value % 64) - 32;
+        }
+        else if (def->length == 3)
+        {
+            value = 0x0200 + value % 0x3E00;
+        }
+        unsigned char instruction[3] = { (unsigned char)def->id, (unsigned char)(value & 0xFF), (unsigned char)((value >> 8) & 0xFF) };
+        for (int i = 0; (i < def->length) && (offset < size); i++)
+        {
+            bytes[offset++] = instruction[i];
+        }
+    }
+}
+
+void bench_random_binary(unsigned char *bytes, int size, unsigned int seed)
+{
+    for (int i = 0; i < size; i++)
+    {
+        bytes[i] = bench_random(&seed) & 0xFF;
+    }
+}
+
+int bench_count_instructions(const unsigned char *bytes, int size)
+{
+    int lines = 0;
+    for (int offset = 0; offset < size; lines++)
+    {
+        offset += opcodes[bytes[offset]].length;
+    }
+    return lines;
+}
+
+int bench_result_count = 0;
+
+void bench_report(const char *name, const char *workload, int lines, long long bytes, int runs, double seconds)
+{
+    if (seconds < 1e-9)
+    {
+        seconds = 1e-9;
+    }
+    printf("%s\n    { \"name\": \"%s\", \"workload\": \"%s\", \"lines\": %d, \"bytes\": %lld, \"runs\": %d, "
+        "\"seconds\": %.6f, \"lines_per_s\": %.0f, \"bytes_per_s\": %.0f }",
+        bench_result_count ? "," : "", name, workload, lines, bytes, runs, seconds,
+        (double)lines * runs / seconds, (double)bytes * runs / seconds);
+    bench_result_count++;
+}
+
+// next line of the source, the same way translate_program splits it
+inline const char *bench_next_line(const char *c, const char *end, int *length)
+{
+    const char *line = c;
+    while ((c < end) && (*c != '\n') && (*c != '\r') && (*c != 0))
+    {
+        c++;
+    }
+    *length = (int)(c - line);
+    return c + 1;
+}
+
+void bench_source_phases(const char *workload, int target_lines)
+{
+    output_buffer src;
+    output_init(&src, 0, 1024 * 1024);
+    int lines = bench_source(&src, target_lines, 12345);
+    const char *program = src.data;
+    const char *end = src.data + src.used;
+    int size = src.used;
+
+    // smaller workloads are repeated so every phase covers about a million lines
+    int runs = (1000000 + lines - 1) / lines;
+
+    // the source rewinds to $0600 every 256 blocks, the overlap reports would end up in the
+    // JSON on stdout
+    assembler as;
+    assembler_init(&as, 0);
+    as.quiet = true;
+
+    // parse_line
+    parsed_line parsed;
+    int instruction_count = 0;
+    int checksum = 0;
+    double t0 = get_seconds();
+    for (int run = 0; run < runs; run++)
+    {
+        for (const char *c = program; c < end; )
+        {
+            int length;
+            const char *line = c;
+            c = bench_next_line(c, end, &length);
+            parse_line(line, length, &parsed);
+            checksum += parsed.op.length;
+        }
+    }
+    double t1 = get_seconds();
+    bench_report("parse_line", workload, lines, size, runs, t1 - t0);
+
+    // translate_program, fresh symbol tables every run
+    t0 = get_seconds();
+    for (int run = 0; run < runs; run++)
+    {
+        assembler_reset(&as);
+        translate_program(&as, program, as.out_data, size, 0x600);
+    }
+    t1 = get_seconds();
+    bench_report("translate_program", workload, lines, size, runs, t1 - t0);
+
+    // get_address_mode and translate_instruction on the instruction lines, with every symbol defined
+    for (const char *c = program; c < end; )
+    {
+        int length;
+        const char *line = c;
+        c = bench_next_line(c, end, &length);
+        parse_line(line, length, &parsed);
+        if ((parsed.op.length > 0) && (parsed.op.text[0] != '*') && !view_equals(parsed.op, "DEFINE") && !view_equals(parsed.op, "DCB"))
+        {
+            instruction_count++;
+        }
+    }
+    text_view *ops = (text_view *)malloc(instruction_count * sizeof(text_view));
+    text_view *args = (text_view *)malloc(instruction_count * sizeof(text_view));
+    address_mode *modes = (address_mode *)malloc(instruction_count * sizeof(address_mode));
+    int *addresses = (int *)malloc(instruction_count * sizeof(int));
+    int n = 0;
+    long long instruction_bytes = 0;
+    for (const char *c = program; c < end; )
+    {
+        int length;
+        const char *line = c;
+        c = bench_next_line(c, end, &length);
+        parse_line(line, length, &parsed);
+        if ((parsed.op.length > 0) && (parsed.op.text[0] != '*') && !view_equals(parsed.op, "DEFINE") && !view_equals(parsed.op, "DCB"))
+        {
+            ops[n] = parsed.op;
+            args[n] = parsed.args;
+            instruction_bytes += parsed.args.length;
+            n++;
+        }
+    }
+
+    t0 = get_seconds();
+    for (int run = 0; run < runs; run++)
+    {
+        for (int i = 0; i < instruction_count; i++)
+        {
+            operand_ref ref;
+            modes[i] = get_address_mode(&as, args[i], 0x600, &addresses[i], &ref);
+        }
+    }
+    t1 = get_seconds();
+    bench_report("get_address_mode", workload, instruction_count, instruction_bytes, runs, t1 - t0);
+
+    unsigned char *scratch = (unsigned char *)malloc(OUT_BUFFER_SIZE);
+    long long code_bytes = 0;
+    t0 = get_seconds();
+    for (int run = 0; run < runs; run++)
+    {
+        int offset = 0x600;
+        for (int i = 0; i < instruction_count; i++)
+        {
+            offset += translate_instruction(ops[i], modes[i], offset, addresses[i], 0, scratch + offset, 0);
+            if (offset > 0xF000)
+            {
+                code_bytes += offset - 0x600;
+                offset = 0x600;
+            }
+        }
+        code_bytes += offset - 0x600;
+    }
+    t1 = get_seconds();
+    bench_report("translate_instruction", workload, instruction_count, code_bytes / runs, runs, t1 - t0);
+
+    // end to end: assemble and write the listing of the 64K image
+    FILE *f = tmpfile();
+    if (f)
+    {
+        int image_size = OUT_BUFFER_SIZE - 0x600;
+        t0 = get_seconds();
+        for (int run = 0; run < runs; run++)
+        {
+            rewind(f);
+            assembler_reset(&as);
+            translate_program(&as, program, as.out_data, size, 0x600);
+            disasm_program(as.out_data + 0x600, image_size, 0x600, f);
+            fflush(f);
+        }
+        t1 = get_seconds();
+        bench_report("end_to_end", workload, lines, size, runs, t1 - t0);
+        fclose(f);
+    }
+
+    if (checksum == 0)
+    {
+        fputc('\n', stderr);  // keeps the parse loop from being optimized away
+    }
+
+    free(scratch);
+    free(ops);
+    free(args);
+    free(modes);
+    free(addresses);
+    assembler_free(&as);
+    output_free(&src);
+}
+
+void bench_disasm(const char *workload, unsigned char *bytes, int size)
+{
+    FILE *f = tmpfile();
+    if (!f)
+    {
+        return;
+    }
+    int lines = bench_count_instructions(bytes, size);
+    double t0 = get_seconds();
+    disasm_program(bytes, size, 0x600, f);
+    fflush(f);
+    double t1 = get_seconds();
+    bench_report("disasm_program", workload, lines, size, 1, t1 - t0);
+
+    output_buffer out;
+    output_init(&out, f, OUTPUT_BUFFER_SIZE);
+    t0 = get_seconds();
+    disasm_listing_cycles(bytes, size, 0x600, &out);
+    report_loops(bytes, size, 0x600, &out);
+    output_flush(&out);
+    t1 = get_seconds();
+    bench_report("disasm_cycles", workload, lines, size, 1, t1 - t0);
+    output_free(&out);
+    fclose(f);
+}
+
+// fill, checksum through a pointer and a shift loop with subroutine calls, forever
+const char *bench_cpu_program =
+    "        ldx #$ff\n"
+    "        txs\n"
+    "        lda #$00\n"
+    "        sta $12\n"
+    "        lda #$02\n"
+    "        sta $13\n"
+    "main:   ldx #$00\n"
+    "fill:   txa\n"
+    "        sta $0200,x\n"
+    "        eor #$5a\n"
+    "        sta $0300,x\n"
+    "        inx\n"
+    "        bne fill\n"
+    "        lda #$00\n"
+    "        sta $10\n"
+    "        sta $11\n"
+    "        ldy #$00\n"
+    "sum:    lda ($12),y\n"
+    "        clc\n"
+    "        adc $10\n"
+    "        sta $10\n"
+    "        bcc nocarry\n"
+    "        inc $11\n"
+    "nocarry: iny\n"
+    "        bne sum\n"
+    "        jsr shift\n"
+    "        jmp main\n"
+    "shift:  ldx #$20\n"
+    "loop:   asl $10\n"
+    "        rol $11\n"
+    "        lda $11\n"
+    "        cmp #$80\n"
+    "        bcs skip\n"
+    "        pha\n"
+    "        pla\n"
+    "skip:   dex\n"
+    "        bpl loop\n"
+    "        rts\n";
+
+void bench_cpu()
+{
+    assembler as;
+    assembler_init(&as, 0);
+    as.quiet = true;
+    int size = asm_program(&as, bench_cpu_program, as.out_data, (int)strlen(bench_cpu_program), 0x600);
+
+    int instructions = 200000000;
+    cpu c;
+    cpu_reset(&c, as.out_data, 0x600);
+    double t0 = get_seconds();
+    cpu_run(&c, instructions);
+    double t1 = get_seconds();
+    bench_report("cpu_run", "loops", instructions, size, 1, t1 - t0);
+
+    assembler_free(&as);
+}
+
+int bench_suite()
+{
+    printf("{\n  \"benchmarks\": [");
+
+    bench_source_phases("source_10k", 10000);
+    bench_source_phases("source_100k", 100000);
+    bench_source_phases("source_1m", 1000000);
+
+    int size = 4 * 1024 * 1024;
+    unsigned char *bytes = (unsigned char *)malloc(size);
+    bench_random_binary(bytes, size, 12345);
+    bench_disasm("random_4m", bytes, size);
+    bench_code_binary(bytes, size, 12345);
+    bench_disasm("code_4m", bytes, size);
+    free(bytes);
+
+    bench_cpu();
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
+
+// "-" (stdin), a pipe, FIFO or device: listed with disasm_stream as it is read
+bool is_stream(const char *name)
+{
+    if (strcmp(name, "-") == 0)
+    {
+        return true;
+    }
+    struct stat st;
+    return (stat(name, &st) == 0) && ((st.st_mode & S_IFMT) != S_IFREG);
+}
+
+FILE *open_stream(const char *name)
+{
+    if (strcmp(name, "-") == 0)
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        return stdin;
+    }
+    FILE *f;
+    fopen_s(&f, name, "rb");
+    return f;
+}
+
+void close_stream(FILE *f)
+{
+    if (f != stdin)
+    {
+        fclose(f);
+    }
+}
+
+// assembled output files (-f). the hex formats only hold the populated segments, the
+// plain image formats hold everything from the lowest to the highest populated address.
+// all of them use image offsets, so banks follow each other in the file
+
+enum binary_format
+{
+    binary_none,
+    binary_raw,  // -fbin
+    binary_prg,  // -fprg: Commodore, load address first, unbanked images below $10000 only
+    binary_ihex, // -fhex: Intel HEX
+    binary_srec, // -fsrec: Motorola S-record, 24 bit addresses past 64 KB
+};
+
+#define HEX_RECORD_BYTES 16
+
+inline char *put_hex_upper(char *p, unsigned int value)
+{
+    const char *digits = "0123456789ABCDEF";
+    p[0] = digits[(value >> 4) & 0xF];
+    p[1] = digits[value & 0xF];
+    return p + 2;
+}
+
+// ":LLAAAATT<data>CC", the checksum makes the sum of all bytes zero
+void ihex_record(output_buffer *out, int type, int address, const unsigned char *data, int length)
+{
+    char *start = output_reserve(out, 16 + length * 2);
+    char *p = start;
+    unsigned int sum = length + (address >> 8) + address + type;
+    *p++ = ':';
+    p = put_hex_upper(p, length);
+    p = put_hex_upper(p, address >> 8);
+    p = put_hex_upper(p, address);
+    p = put_hex_upper(p, type);
+    for (int i = 0; i < length; i++)
+    {
+        p = put_hex_upper(p, data[i]);
+        sum += data[i];
+    }
+    p = put_hex_upper(p, -(int)sum);
+    *p++ = '\n';
+    out->used += (int)(p - start);
+}
+
+// "S<type>LLAAAA<data>CC", LL counts address, data and checksum, which is the ones'
+// complement of the sum of those and LL. S2 and S8 records have a third address byte
+void srec_record(output_buffer *out, int type, int address, const unsigned char *data, int length)
+{
+    char *start = output_reserve(out, 18 + length * 2);
+    char *p = start;
+    bool wide = (type == 2) || (type == 8);
+    unsigned int sum = (length + (wide ? 4 : 3)) + (address >> 16) + (address >> 8) + address;
+    *p++ = 'S';
+    *p++ = (char)('0' + type);
+    p = put_hex_upper(p, length + (wide ? 4 : 3));
+    if (wide)
+    {
+        p = put_hex_upper(p, address >> 16);
+    }
+    p = put_hex_upper(p, address >> 8);
+    p = put_hex_upper(p, address);
+    for (int i = 0; i < length; i++)
+    {
+        p = put_hex_upper(p, data[i]);
+        sum += data[i];
+    }
+    p = put_hex_upper(p, ~sum);
+    *p++ = '\n';
+    out->used += (int)(p - start);
+}
+
+void write_binary(assembler *as, binary_format format, int entry, output_buffer *out)
+{
+    const unsigned char *bytes = as->out_data;
+    int first;
+    int span = segment_span(as, &first);
+    switch (format)
+    {
+        case binary_prg:
+        {
+            unsigned char load_address[2] = { (unsigned char)first, (unsigned char)(first >> 8) };
+            output_write(out, (const char *)load_address, 2);
+            output_write(out, (const char *)bytes + first, span);
+            break;
+        }
+        case binary_raw:
+            output_write(out, (const char *)bytes + first, span);
+            break;
+        case binary_ihex:
+        case binary_srec:
+        {
+            // past 64 KB: S2 records, and Intel HEX type 04 records for the upper 16 bits
+            bool wide = first + span > 0x10000;
+            int upper = 0;
+            if (format == binary_srec)
+            {
+                srec_record(out, 0, 0, 0, 0);
+            }
+            for (int i = 0; i < as->segment_count; i++)
+            {
+                int end = as->segments[i].start + as->segments[i].length;
+                for (int address = as->segments[i].start; address < end; )
+                {
+                    int length = (end - address < HEX_RECORD_BYTES) ? end - address : HEX_RECORD_BYTES;
+                    if (format == binary_ihex)
                     {
-                        if (_stricmp(parsed.op, "DCB") == 0)
-                        {
-                            // TODO: implement
-                            offset += translate_dcb(parsed.args, bytes + offset);
-                        }
-                        else if (parsed.op[0] == '*')
+                        // a record can't cross into the next 64 KB
+                        if ((address >> 16) != upper)
                         {
-                            offset = parse_value(parsed.args);
+                            upper = address >> 16;
+                            unsigned char extended[2] = { (unsigned char)(upper >> 8), (unsigned char)upper };
+                            ihex_record(out, 4, 0, extended, 2);
                         }
-                        else
+                        if ((address & 0xFFFF) + length > 0x10000)
                         {
-                            int address = 0;
-                            address_mode mode = get_address_mode(parsed.args, &address);
-                            offset += translate_instruction(parsed.op, mode, offset, address, bytes + offset);
+                            length = 0x10000 - (address & 0xFFFF);
                         }
+                        ihex_record(out, 0, address & 0xFFFF, bytes + address, length);
+                    }
+                    else
+                    {
+                        srec_record(out, wide ? 2 : 1, address, bytes + address, length);
                     }
+                    address += length;
+                }
+            }
+            if (format == binary_ihex)
+            {
+                ihex_record(out, 1, 0, 0, 0);
+            }
+            else
+            {
+                srec_record(out, wide ? 8 : 9, entry, 0, 0);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+binary_format parse_binary_format(const char *name)
+{
+    if (strcmp(name, "bin") == 0)
+    {
+        return binary_raw;
+    }
+    if (strcmp(name, "prg") == 0)
+    {
+        return binary_prg;
+    }
+    if (strcmp(name, "hex") == 0)
+    {
+        return binary_ihex;
+    }
+    if (strcmp(name, "srec") == 0)
+    {
+        return binary_srec;
+    }
+    return binary_none;
+}
+
+// one input file from the command line, with the options in effect at its position
+
+struct asm_job
+{
+    const char *name;
+    int base_address;
+    bool disasm;
+    bool trace; // -r: recursive traversal instead of linear sweep
+    stats_format stats;
+    long long run_limit; // -x: execute the assembled image for at most this many instructions
+    bool optimize;       // -O: peephole rewrites
+    bool cycles;         // -c: cycle counts in the listing and a loop report
+    binary_format format; // -f: also write the assembled output
+    int bank_size;        // -k: list a -d input as banks of this size, each at the base address
+    bool symbols;         // -s: also write a symbol file
+    output_buffer log; // status messages and -d listing, printed in job order
+    bool stream;       // listed as it is read, see run_jobs_parallel
+    bool done;
+
+    // --server: the input came with the request, output files go back in the response
+    unsigned char *data;
+    int size;
+    output_buffer *files;
+};
+
+// "name.asm" -> "../disasm/name.<extension>"
+void output_name(const char *name, const char *extension, char (&outname)[100])
+{
+    strcpy_s(outname, sizeof(outname), "../disasm/");
+    strcat_s(outname, name);
+    int len = strnlen_s(outname, sizeof(outname));
+    outname[len - 3] = 0;
+    strcat_s(outname, extension);
+}
+
+void listing_name(const char *name, char (&outname)[100])
+{
+    output_name(name, "disasm", outname);
+}
+
+// "Bank $NN" above the listing of each bank
+void bank_header(int bank, output_buffer *out)
+{
+    char *start = output_reserve(out, 16);
+    char *p = start;
+    memcpy(p, "\nBank $", 7);
+    p = put_hex_byte(p + 7, bank);
+    *p++ = '\n';
+    out->used += (int)(p - start);
+}
+
+// banked output is listed per segment, at the addresses the CPU sees
+int disasm_segments(assembler *as, bool cycles, output_buffer *out)
+{
+    int count = 0;
+    int bank = -1;
+    for (int i = 0; i < as->segment_count; i++)
+    {
+        segment *s = &as->segments[i];
+        if (s->bank != bank)
+        {
+            bank = s->bank;
+            bank_header(bank, out);
+        }
+        if (cycles)
+        {
+            count += disasm_listing_cycles(as->out_data + s->start, s->length, s->address, out);
+        }
+        else
+        {
+            count += disasm_listing(as->out_data + s->start, s->length, s->address, out);
+        }
+    }
+    return count;
+}
+
+// -k: a ROM dump as consecutive banks, each seen at base_address. the listing reads
+// the banks where they are in the input
+int disasm_banks(unsigned char *bytes, int size, int bank_size, int base_address, bool cycles, output_buffer *out)
+{
+    int count = 0;
+    for (int bank = 0; bank * bank_size < size; bank++)
+    {
+        int offset = bank * bank_size;
+        int length = (size - offset < bank_size) ? size - offset : bank_size;
+        bank_header(bank, out);
+        if (cycles)
+        {
+            count += disasm_listing_cycles(bytes + offset, length, base_address, out);
+        }
+        else
+        {
+            count += disasm_listing(bytes + offset, length, base_address, out);
+        }
+    }
+    return count;
+}
+
+// easy6502 conventions: $FE reads a new random byte on every access, BRK ends the program
+unsigned char easy6502_read(cpu *c, int)
+{
+    unsigned int *seed = (unsigned int *)c->io_context;
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0xFF;
+}
+
+void run_image(assembler *as, asm_job *job)
+{
+    // the program may write anywhere, out_data has to stay zero outside the segments.
+    // there is no bank switching, the CPU sees bank 0
+    unsigned char *memory = (unsigned char *)calloc(OUT_BUFFER_SIZE, 1);
+    for (int i = 0; i < as->segment_count; i++)
+    {
+        segment *s = &as->segments[i];
+        if ((s->bank == 0) && (s->address + s->length <= OUT_BUFFER_SIZE))
+        {
+            memcpy(memory + s->address, as->out_data + s->start, s->length);
+        }
+    }
+
+    unsigned int seed = 12345;
+    cpu c;
+    cpu_reset(&c, memory, job->base_address);
+    c.io_start = 0xFE;
+    c.io_size = 1;
+    c.io_read = easy6502_read;
+    c.io_context = &seed;
+
+    double t0 = as->stats ? get_seconds() : 0;
+    cpu_stop stop = cpu_run(&c, job->run_limit);
+    if (as->stats)
+    {
+        as->stats->execute_seconds = get_seconds() - t0;
+        as->stats->executed = c.instructions;
+    }
+
+    static const char *reasons[] = { "running", "BRK", "undocumented opcode", "instruction limit" };
+    report(as, "Executed %lld instructions, stopped at $%04x (%s)  A=$%02x X=$%02x Y=$%02x SP=$%02x P=$%02x\n",
+        c.instructions, c.pc, reasons[stop], c.a, c.x, c.y, c.sp, cpu_status(&c, 0));
+    free(memory);
+}
+
+// an output file of a job, written to disk or for the server collected in job->files as
+// name size, data size, name, data
+bool begin_output(assembler *as, asm_job *job, const char *outname, output_buffer *out)
+{
+    report(as, "Writing to file: %s\n", outname);
+    FILE *f = 0;
+    if (!job->files)
+    {
+        fopen_s(&f, outname, "wb");
+        if (!f)
+        {
+            report(as, "Error opening output file: %s\n", outname);
+            return false;
+        }
+    }
+    output_init(out, f, OUTPUT_BUFFER_SIZE);
+    return true;
+}
+
+void end_output(asm_job *job, const char *outname, output_buffer *out)
+{
+    FILE *f = out->file;
+    if (job->files)
+    {
+        unsigned int sizes[2] = { (unsigned int)strlen(outname), (unsigned int)out->used };
+        output_write(job->files, (const char *)sizes, sizeof(sizes));
+        output_write(job->files, outname, sizes[0]);
+        output_write(job->files, out->data, out->used);
+    }
+    output_free(out);
+    if (f)
+    {
+        fclose(f);
+    }
+}
+
+void run_job(assembler *as, asm_job *job)
+{
+    asm_stats stats = {};
+    as->stats = job->stats ? &stats : 0;
+    double t0 = job->stats ? get_seconds() : 0;
+
+    // a linear listing of a pipe is written while it is read, everything else needs the whole input
+    input_file in = {};
+    FILE *stream = 0;
+    if (job->data)
+    {
+        in.data = job->data;
+        in.size = job->size;
+    }
+    else if (job->disasm && !job->trace && is_stream(job->name))
+    {
+        stream = open_stream(job->name);
+    }
+    if (!job->data && !stream && !open_input(job->name, &in))
+    {
+        report(as, "Error opening input file: %s\n", job->name);
+        as->stats = 0;
+        return;
+    }
+
+    report(as, "Processing file: %s\n", job->name);
+    assembler_reset(as);
+    if (job->stats)
+    {
+        stats.load_seconds = get_seconds() - t0;
+    }
+
+    if (!job->disasm)
+    {
+        as->optimize = job->optimize;
+        as->source_name = job->name;
+        asm_program(as, (const char *)in.data, as->out_data, in.size, job->base_address);
+        if (job->optimize)
+        {
+            print_peephole(as);
+            as->optimize = false;
+        }
+
+        // everything from the lowest populated address, which can be below the base address
+        int first;
+        int out_size = segment_span(as, &first);
+
+        char outname[100];
+        listing_name(job->name, outname);
+        output_buffer out;
+        if (begin_output(as, job, outname, &out))
+        {
+            double t1 = job->stats ? get_seconds() : 0;
+            int instructions;
+            if (segments_banked(as))
+            {
+                instructions = disasm_segments(as, job->cycles, &out);
+            }
+            else if (job->cycles)
+            {
+                instructions = disasm_listing_cycles(as->out_data + first, out_size, first, &out);
+            }
+            else
+            {
+                instructions = disasm_listing(as->out_data + first, out_size, first, &out);
+            }
+            output_flush(&out);
+            if (job->stats)
+            {
+                stats.listing_seconds = get_seconds() - t1;
+                stats.disasm_bytes = out_size;
+                stats.disasm_instructions = instructions;
+                stats.listing_bytes = out.written + out.used;
+            }
+            end_output(job, outname, &out);
+        }
+
+        if (job->format != binary_none)
+        {
+            static const char *extensions[] = { "", "bin", "prg", "hex", "s19" };
+            output_name(job->name, extensions[job->format], outname);
+            // the PRG header is a 16 bit load address for one flat block
+            if ((job->format == binary_prg) && (segments_banked(as) || (first + out_size > 0x10000)))
+            {
+                report(as, "PRG output needs an unbanked image below $10000: %s\n", outname);
+            }
+            else if (begin_output(as, job, outname, &out))
+            {
+                write_binary(as, job->format, job->base_address, &out);
+                end_output(job, outname, &out);
+            }
+        }
+
+        if (job->symbols)
+        {
+            output_name(job->name, "sym", outname);
+            if (begin_output(as, job, outname, &out))
+            {
+                write_symbols(as, &out);
+                end_output(job, outname, &out);
+            }
+        }
+
+        if (job->cycles && segments_banked(as))
+        {
+            for (int i = 0; i < as->segment_count; i++)
+            {
+                segment *s = &as->segments[i];
+                report_loops(as->out_data + s->start, s->length, s->address, as->log);
+            }
+        }
+        else if (job->cycles)
+        {
+            report_loops(as->out_data + first, out_size, first, as->log);
+        }
+
+        if (job->run_limit)
+        {
+            run_image(as, job);
+        }
+    }
+    else
+    {
+        double t1 = job->stats ? get_seconds() : 0;
+        long long listing_start = as->log->written + as->log->used;
+        int instructions = 0;
+        if (stream)
+        {
+            long long stream_instructions;
+            long long stream_bytes = disasm_stream(stream, job->base_address, job->cycles, as->log, &stream_instructions);
+            close_stream(stream);
+            if (job->stats)
+            {
+                stats.listing_seconds = get_seconds() - t1;
+                stats.disasm_bytes = stream_bytes;
+                stats.disasm_instructions = stream_instructions;
+                stats.listing_bytes = as->log->written + as->log->used - listing_start;
+            }
+        }
+        else
+        {
+            if (job->trace)
+            {
+                instructions = disasm_traced(in.data, in.size, job->base_address, as->log);
+            }
+            else if (job->bank_size > 0)
+            {
+                instructions = disasm_banks(in.data, in.size, job->bank_size, job->base_address, job->cycles, as->log);
+            }
+            else if (job->cycles)
+            {
+                instructions = disasm_listing_cycles(in.data, in.size, job->base_address, as->log);
+            }
+            else
+            {
+                instructions = disasm_listing(in.data, in.size, job->base_address, as->log);
+            }
+            if (job->cycles && !job->trace && (job->bank_size > 0))
+            {
+                for (int offset = 0; offset < in.size; offset += job->bank_size)
+                {
+                    int length = (in.size - offset < job->bank_size) ? in.size - offset : job->bank_size;
+                    report_loops(in.data + offset, length, job->base_address, as->log);
+                }
+            }
+            else if (job->cycles)
+            {
+                report_loops(in.data, in.size, job->base_address, as->log);
+            }
+            if (job->stats)
+            {
+                stats.listing_seconds = get_seconds() - t1;
+                stats.disasm_bytes = in.size;
+                stats.disasm_instructions = instructions;
+                stats.listing_bytes = as->log->written + as->log->used - listing_start;
+            }
+        }
+    }
+
+    if (!job->data)
+    {
+        close_input(&in);
+    }
+
+    if (job->stats)
+    {
+        print_stats(as, job->name, job->stats);
+    }
+    as->stats = 0;
+}
+
+// jobs are picked up by a pool of worker threads, each with its own assembler,
+// while the main thread prints the logs in command line order as the jobs finish
+void run_jobs_parallel(asm_job *jobs, int job_count, int threads)
+{
+    std::atomic<int> next_job(0);
+    std::mutex mutex;
+    std::condition_variable job_done;
+
+    int listing_threads = disasm_threads;
+    auto worker = [&]()
+    {
+        disasm_threads = listing_threads;
+        assembler as;
+        assembler_init(&as, 0);
+        for (;;)
+        {
+            int i = next_job++;
+            if (i >= job_count)
+            {
+                break;
+            }
+            if (jobs[i].stream)
+            {
+                continue;
+            }
+            as.log = &jobs[i].log;
+            run_job(&as, &jobs[i]);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs[i].done = true;
+            job_done.notify_all();
+        }
+        assembler_free(&as);
+    };
+
+    // a stream has no size to bound its listing, so it isn't buffered: the main thread lists it
+    // to stdout in its turn while the workers go on with the files after it
+    for (int i = 0; i < job_count; i++)
+    {
+        jobs[i].stream = jobs[i].disasm && !jobs[i].trace && is_stream(jobs[i].name);
+    }
+
+    if (threads > job_count)
+    {
+        threads = job_count;
+    }
+    std::thread *workers = new std::thread[threads];
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i] = std::thread(worker);
+    }
+
+    for (int i = 0; i < job_count; i++)
+    {
+        if (jobs[i].stream)
+        {
+            output_free(&jobs[i].log);
+            output_buffer log;
+            output_init(&log, stdout, OUTPUT_BUFFER_SIZE);
+            assembler as;
+            assembler_init(&as, &log);
+            run_job(&as, &jobs[i]);
+            assembler_free(&as);
+            output_free(&log);
+            continue;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_done.wait(lock, [&]() { return jobs[i].done; });
+        }
+        fwrite(jobs[i].log.data, 1, jobs[i].log.used, stdout);
+        output_free(&jobs[i].log);
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].join();
+    }
+    delete[] workers;
+}
+
+// --watch: reassemble a file whenever it changes, reusing the previous parse and encoding
+// of every line that did not change. the new text is compared with the old one byte by byte,
+// only the lines between the common start and end are split, tokenized and compiled again. an edit that only replaced
+// instructions and data by the same number of bytes and kept the labels where they were is
+// patched into the previous output, see watch_patch. anything else assembles the whole file
+// again, where a clean line is only re-encoded when the value of its operand expression
+// changed (or its address did, for branches), and the listing is kept up to the first byte
+// that changed, and after the last one when the output has the same size.
+
+enum line_kind
+{
+    line_empty,
+    line_instruction,
+    line_dcb,
+    line_define,
+    line_origin,
+};
+
+struct watch_line
+{
+    const char *text;
+    int length;
+    bool dirty;
+
+    // parse results, views into text
+    parsed_line parsed;
+    line_kind kind;
+    address_mode mode;
+    text_view define_name;
+
+    // compiled operand, define value or origin, ops are owned by the line
+    const char *expr_text;
+    expr_op *ops;
+    int op_count;
+
+    // previous encoding
+    int address;
+    int size;
+    int operand; // operand value used for the encoding
+};
+
+struct watch_state
+{
+    const char *name;
+    int base_address;
+    long long stamp;
+    long long file_size;
+
+    char *source; // lines point into it
+    int source_size;
+    int source_capacity;
+    watch_line *lines;
+    int line_count;
+    int line_capacity;
+
+    assembler as;             // symbols of the previous assembly
+    unsigned char *prev_data; // output of the previous assembly
+    int prev_written[2];      // image range [low, high) written to prev_data
+    int spare_written[2];     // and to as.out_data, cleared before it's used again
+    int out_size;
+    bool grown;               // it needed grow only layout passes
+    bool clean;               // it had no errors
+
+    // lines replaced by the last edit, see watch_patch
+    bool patchable;
+    int patch_first;
+    int patch_count;
+    int patch_address;
+    int patch_size;
+    output_buffer patch_labels; // address, name length and name of each label they had
+
+    output_buffer listing;
+    int *listing_offsets;   // offset of each listed instruction
+    int *listing_positions; // position of its line in listing.data
+    int listing_count;
+    int listing_capacity;
+};
+
+// moves the views of a line that was kept to where its text is now
+void rebase_line(watch_line *l, const char *old_base, const char *new_base)
+{
+    l->text = new_base + (l->text - old_base);
+    if (l->length > 0)
+    {
+        l->parsed.label.text = new_base + (l->parsed.label.text - old_base);
+        l->parsed.op.text = new_base + (l->parsed.op.text - old_base);
+        l->parsed.args.text = new_base + (l->parsed.args.text - old_base);
+    }
+    if (l->kind == line_define)
+    {
+        l->define_name.text = new_base + (l->define_name.text - old_base);
+    }
+    if (l->expr_text)
+    {
+        l->expr_text = new_base + (l->expr_text - old_base);
+    }
+}
+
+// reads the file and replaces the lines that changed since the previous version. lines
+// before the first and after the last changed byte keep their state, and only the ones
+// after the edit move when its length changed
+bool watch_load(watch_state *w)
+{
+    FILE *f;
+    fopen_s(&f, w->name, "rb");
+    if (!f)
+    {
+        return false;
+    }
+    input_file in;
+    read_input(f, &in);
+    fclose(f);
+    const char *data = (const char *)in.data;
+    int size = in.size;
+    const char *nul = (const char *)memchr(data, 0, size);
+    if (nul)
+    {
+        // the lines end there
+        size = (int)(nul - data);
+    }
+
+    // common bytes at the start and the end
+    int common = (size < w->source_size) ? size : w->source_size;
+    int head = 0;
+    while ((head + 64 <= common) && (memcmp(data + head, w->source + head, 64) == 0))
+    {
+        head += 64;
+    }
+    while ((head < common) && (data[head] == w->source[head]))
+    {
+        head++;
+    }
+    int tail = 0;
+    while ((tail + 64 <= common - head) && (memcmp(data + size - tail - 64, w->source + w->source_size - tail - 64, 64) == 0))
+    {
+        tail += 64;
+    }
+    while ((tail < common - head) && (data[size - 1 - tail] == w->source[w->source_size - 1 - tail]))
+    {
+        tail++;
+    }
+
+    // a line is kept when its text and the terminators around it are common
+    int prefix = 0;
+    int high = w->line_count;
+    while (prefix < high)
+    {
+        int middle = (prefix + high) / 2;
+        if (w->lines[middle].text - w->source + w->lines[middle].length < head)
+        {
+            prefix = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    int first_suffix = w->line_count;
+    int low = prefix;
+    while (low < first_suffix)
+    {
+        int middle = (low + first_suffix) / 2;
+        if (w->lines[middle].text - w->source > w->source_size - tail)
+        {
+            first_suffix = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    int suffix = w->line_count - first_suffix;
+
+    // split the lines in between the same way translate_program does
+    int delta = size - w->source_size;
+    int start = (prefix > 0) ? (int)(w->lines[prefix - 1].text - w->source) + w->lines[prefix - 1].length + 1 : 0;
+    int stop = suffix ? (int)(w->lines[first_suffix].text - w->source) + delta : size;
+    int capacity = 16;
+    int count = 0;
+    watch_line *lines = (watch_line *)malloc(capacity * sizeof(watch_line));
+    const char *c = data + start;
+    const char *end = data + stop;
+    while (c < end)
+    {
+        const char *line = c;
+        while ((c < end) && (*c != '\n') && (*c != '\r'))
+        {
+            c++;
+        }
+        if (count == capacity)
+        {
+            capacity *= 2;
+            lines = (watch_line *)realloc(lines, capacity * sizeof(watch_line));
+        }
+        watch_line *l = &lines[count++];
+        l->text = line;
+        l->length = (int)(c - line);
+        l->dirty = true;
+        c++;
+    }
+
+    // the lines that were replaced can be patched when they define no constant and the
+    // previous assembly was complete. their labels are kept to check the new lines have the
+    // same ones at the same addresses
+    int replaced_end = w->line_count - suffix;
+    w->patchable = w->clean && (prefix < w->line_count);
+    w->patch_first = prefix;
+    w->patch_count = count;
+    w->patch_address = w->patchable ? w->lines[prefix].address : 0;
+    w->patch_size = 0;
+    if (!w->patch_labels.data)
+    {
+        output_init(&w->patch_labels, 0, 256);
+    }
+    w->patch_labels.used = 0;
+    for (int old = prefix; w->patchable && (old < replaced_end); old++)
+    {
+        watch_line *l = &w->lines[old];
+        w->patchable = (l->kind == line_empty) || (l->kind == line_instruction) || (l->kind == line_dcb);
+        w->patch_size += l->size;
+        if (l->parsed.label.length > 0)
+        {
+            int label[2] = { l->address, l->parsed.label.length };
+            output_write(&w->patch_labels, (const char *)label, sizeof(label));
+            output_write(&w->patch_labels, l->parsed.label.text, l->parsed.label.length);
+        }
+    }
+
+    // compiled expressions of the lines that were replaced
+    for (int old = prefix; old < replaced_end; old++)
+    {
+        free(w->lines[old].ops);
+    }
+
+    // the new text replaces the old one in place, kept lines only move when the buffer does
+    char *old_source = w->source;
+    if (!w->source || (size > w->source_capacity))
+    {
+        w->source_capacity = size + size / 2 + 4096;
+        w->source = (char *)malloc(w->source_capacity);
+    }
+    memcpy(w->source, data, size);
+    w->source_size = size;
+    if (w->source != old_source)
+    {
+        for (int i = 0; i < prefix; i++)
+        {
+            rebase_line(&w->lines[i], old_source, w->source);
+        }
+    }
+    if ((w->source != old_source) || (delta != 0))
+    {
+        for (int i = replaced_end; i < w->line_count; i++)
+        {
+            rebase_line(&w->lines[i], old_source, w->source + delta);
+        }
+    }
+    if (w->source != old_source)
+    {
+        free(old_source);
+    }
+
+    int line_count = prefix + count + suffix;
+    if (line_count > w->line_capacity)
+    {
+        w->line_capacity = line_count + line_count / 2 + 1024;
+        w->lines = (watch_line *)realloc(w->lines, w->line_capacity * sizeof(watch_line));
+    }
+    memmove(w->lines + prefix + count, w->lines + replaced_end, suffix * sizeof(watch_line));
+    for (int i = 0; i < count; i++)
+    {
+        w->lines[prefix + i] = lines[i];
+        w->lines[prefix + i].text = w->source + (lines[i].text - data);
+    }
+    w->line_count = line_count;
+
+    free(lines);
+    free(in.data);
+    return true;
+}
+
+// extends the image range [low, high) written to a buffer
+inline void watch_written(int *written, int low, int high)
+{
+    if (written[0] >= written[1])
+    {
+        written[0] = low;
+        written[1] = high;
+    }
+    else
+    {
+        written[0] = (low < written[0]) ? low : written[0];
+        written[1] = (high > written[1]) ? high : written[1];
+    }
+}
+
+inline void watch_clear(unsigned char *bytes, int *written)
+{
+    if (written[0] < written[1])
+    {
+        memset(bytes + written[0], 0, written[1] - written[0]);
+    }
+    written[0] = written[1] = 0;
+}
+
+struct watch_stats
+{
+    int parsed;
+    int encoded;
+    int listing_reused;
+};
+
+// tokenizes an edited line and compiles its expression
+void watch_parse(assembler *as, watch_line *l, int offset, watch_stats *stats)
+{
+    stats->parsed++;
+    l->kind = line_empty;
+    l->size = 0;
+    l->expr_text = 0;
+    l->ops = 0;
+    l->op_count = 0;
+    if (l->length > 0)
+    {
+        parse_line(l->text, l->length, &l->parsed);
+        expr e;
+        e.count = 0;
+        if (view_equals(l->parsed.op, "DEFINE"))
+        {
+            l->kind = line_define;
+            text_view value_text;
+            split_define(l->parsed.args, &l->define_name, &value_text);
+            int used = compile_expr(value_text.text, value_text.length, &e);
+            if ((used < 0) || (used != value_text.length))
+            {
+                report(as, "Invalid expression: %.*s\n", value_text.length, value_text.text);
+                e.count = 0;
+            }
+        }
+        else if (l->parsed.op.length > 0)
+        {
+            if (view_equals(l->parsed.op, "DCB"))
+            {
+                l->kind = line_dcb;
+            }
+            else if (view_equals(l->parsed.op, "BANK") || view_equals(l->parsed.op, "INCLUDE") || view_equals(l->parsed.op, "INCSRC") ||
+                view_equals(l->parsed.op, "IMPORT"))
+            {
+                report(as, "%.*s is not supported in watch mode\n", l->parsed.op.length, l->parsed.op.text);
+            }
+            else if (l->parsed.op.text[0] == '*')
+            {
+                // evaluated by translate_origin
+                l->kind = line_origin;
+            }
+            else
+            {
+                l->kind = line_instruction;
+                operand_ref ref;
+                int address;
+                l->mode = get_address_mode(as, l->parsed.args, offset, &address, &ref);
+                e = ref.value;
+            }
+        }
+        if (e.count > 0)
+        {
+            l->expr_text = e.text;
+            l->ops = (expr_op *)malloc(e.count * sizeof(expr_op));
+            memcpy(l->ops, e.ops, e.count * sizeof(expr_op));
+            l->op_count = e.count;
+        }
+    }
+    else
+    {
+        l->parsed = {};
+    }
+}
+
+// same layout passes as translate_program. only the first one reuses the previous encoding
+// of a line, later ones encode everything again from the symbols of the pass before
+int watch_pass(watch_state *w, assembler *as, watch_stats *stats)
+{
+    unsigned char *bytes = as->out_data;
+    unsigned char *prev = w->prev_data;
+    int offset = w->base_address;
+    as->window_reported = false;
+    for (int i = 0; i < w->line_count; i++)
+    {
+        watch_line *l = &w->lines[i];
+        int old_address = l->address;
+        l->address = offset;
+
+        if (l->dirty)
+        {
+            watch_parse(as, l, offset, stats);
+        }
+
+        if (l->parsed.label.length > 0)
+        {
+            define_label(as, l->parsed.label, offset, bytes);
+        }
+
+        int value;
+        text_view missing;
+        bool defined = eval_expr(as, l->expr_text, l->ops, l->op_count, offset, &value, &missing);
+
+        switch (l->kind)
+        {
+            case line_define:
+                if (defined)
+                {
+                    define_constant(as, l->define_name, value, bytes);
                 }
-                if (*c == 0)
+                else
+                {
+                    add_fixup(as, l->expr_text, l->ops, l->op_count, missing, offset, fixup_define, l->define_name);
+                }
+                break;
+
+            case line_origin:
+                offset = translate_origin(as, l->parsed.args, offset);
+                break;
+
+            case line_dcb:
+                // DCB values can depend on any symbol, always encoded again
+                l->size = translate_dcb(as, l->parsed.args, offset, bytes);
+                watch_written(w->spare_written, offset, offset + l->size);
+                check_window(as, offset, l->size);
+                stats->encoded++;
+                offset += l->size;
+                break;
+
+            case line_instruction:
+            {
+                if (!image_fits(as, offset, 5))
                 {
+                    report(as, "Code outside the output image: %.*s %.*s\n", l->parsed.op.length, l->parsed.op.text, l->parsed.args.length, l->parsed.args.text);
+                    l->size = 0;
                     break;
                 }
-                line = c + 1;
-                length = 0;
+                int operand = defined ? value : deferred_value(l->ops, l->op_count);
+                bool reuse = (as->pass == 1) && !w->grown && !l->dirty && (l->size > 0) && (operand == l->operand);
+                if (reuse && (old_address != offset) && (opcodes[prev[old_address]].mode == address_mode_rel))
+                {
+                    reuse = false; // branch offset depends on its own address
+                }
+                if (reuse)
+                {
+                    memcpy(bytes + offset, prev + old_address, l->size);
+                }
+                else
+                {
+                    int min_length = (as->pass > FREE_LAYOUT_PASSES) ? l->size : 0;
+                    l->size = translate_instruction(l->parsed.op, l->mode, offset, operand, min_length, bytes + offset, 0);
+                    l->operand = operand;
+                    stats->encoded++;
+                }
+                watch_written(w->spare_written, offset, offset + l->size);
+                check_window(as, offset, l->size);
+                if ((l->size > 1) && !defined)
+                {
+                    add_fixup(as, l->expr_text, l->ops, l->op_count, missing, offset, instruction_fixup(bytes[offset]), {});
+                }
+                offset += l->size;
+                break;
             }
-            else
+
+            default:
+                break;
+        }
+        l->dirty = false;
+    }
+
+    if (as->pass == 1)
+    {
+        report_unresolved(as);
+    }
+    return offset - w->base_address;
+}
+
+// disassembles the listing again from the instruction before the bytes [start, end) that
+// changed, until it meets an instruction of the previous listing after them
+void watch_relist(watch_state *w, int start, int end, watch_stats *stats)
+{
+    const unsigned char *bytes = w->prev_data + w->base_address;
+    int *offsets = w->listing_offsets;
+    int first = 0;
+    int high = w->listing_count;
+    while (first < high)
+    {
+        int middle = (first + high) / 2;
+        if (offsets[middle] <= start)
+        {
+            first = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    first = (first > 0) ? first - 1 : 0;
+
+    output_buffer text;
+    output_init(&text, 0, 4096);
+    int capacity = 64;
+    int count = 0;
+    int *new_offsets = (int *)malloc(capacity * sizeof(int));
+    int *new_positions = (int *)malloc(capacity * sizeof(int));
+    int pos = (first < w->listing_count) ? offsets[first] : 0;
+    int next = first;
+    while (pos < w->out_size)
+    {
+        while ((next < w->listing_count) && (offsets[next] < pos))
+        {
+            next++;
+        }
+        if ((pos >= end) && (next < w->listing_count) && (offsets[next] == pos))
+        {
+            break;
+        }
+        if (count == capacity)
+        {
+            capacity *= 2;
+            new_offsets = (int *)realloc(new_offsets, capacity * sizeof(int));
+            new_positions = (int *)realloc(new_positions, capacity * sizeof(int));
+        }
+        new_offsets[count] = pos;
+        new_positions[count] = text.used;
+        count++;
+        pos += disasm_single(bytes, pos, w->out_size, w->base_address, &text);
+    }
+    if (pos >= w->out_size)
+    {
+        next = w->listing_count;
+    }
+
+    // replace the text of entries [first, next) and shift the ones after it
+    int from = (first < w->listing_count) ? w->listing_positions[first] : w->listing.used;
+    int to = (next < w->listing_count) ? w->listing_positions[next] : w->listing.used;
+    int delta = text.used - (to - from);
+    if (delta > 0)
+    {
+        output_reserve(&w->listing, delta);
+    }
+    memmove(w->listing.data + to + delta, w->listing.data + to, w->listing.used - to);
+    memcpy(w->listing.data + from, text.data, text.used);
+    w->listing.used += delta;
+
+    int tail = w->listing_count - next;
+    int listing_count = first + count + tail;
+    if (listing_count > w->listing_capacity)
+    {
+        w->listing_capacity = listing_count;
+        w->listing_offsets = (int *)realloc(w->listing_offsets, w->listing_capacity * sizeof(int));
+        w->listing_positions = (int *)realloc(w->listing_positions, w->listing_capacity * sizeof(int));
+    }
+    memmove(w->listing_offsets + first + count, w->listing_offsets + next, tail * sizeof(int));
+    memmove(w->listing_positions + first + count, w->listing_positions + next, tail * sizeof(int));
+    for (int i = 0; i < count; i++)
+    {
+        w->listing_offsets[first + i] = new_offsets[i];
+        w->listing_positions[first + i] = from + new_positions[i];
+    }
+    for (int i = first + count; i < listing_count; i++)
+    {
+        w->listing_positions[i] += delta;
+    }
+    stats->listing_reused = w->listing_count - (next - first);
+    w->listing_count = listing_count;
+
+    free(new_offsets);
+    free(new_positions);
+    output_free(&text);
+}
+
+// the new output becomes the previous one
+void watch_swap(watch_state *w, assembler *as)
+{
+    unsigned char *bytes = as->out_data;
+    as->out_data = w->prev_data;
+    w->prev_data = bytes;
+    int written[2] = { w->prev_written[0], w->prev_written[1] };
+    w->prev_written[0] = w->spare_written[0];
+    w->prev_written[1] = w->spare_written[1];
+    w->spare_written[0] = written[0];
+    w->spare_written[1] = written[1];
+}
+
+void watch_assemble(watch_state *w, assembler *as, watch_stats *stats)
+{
+    unsigned char *bytes = as->out_data;
+    unsigned char *prev = w->prev_data;
+    watch_clear(bytes, w->spare_written);
+    assembler_reset(as);
+    int reports = as->report_count;
+
+    as->pass = 1;
+    as->layout_changed = false;
+    int out_size = watch_pass(w, as, stats);
+    as->quiet = true;
+    while (as->layout_changed && (as->pass < MAX_LAYOUT_PASSES))
+    {
+        as->pass++;
+        as->layout_changed = false;
+        free_fixups(as);
+        watch_clear(bytes, w->spare_written);
+        out_size = watch_pass(w, as, stats);
+    }
+    as->quiet = false;
+    if (as->layout_changed)
+    {
+        report(as, "Layout did not converge after %d passes\n", as->pass);
+    }
+    w->grown = (as->pass > FREE_LAYOUT_PASSES);
+    w->clean = !as->layout_changed && !w->grown && (as->report_count == reports);
+
+    // keep the listing up to the first byte that changed, and when the size did not change
+    // from where it meets the previous listing after the last one
+    int base = w->base_address;
+    int same = 0;
+    int common = (out_size < w->out_size) ? out_size : w->out_size;
+    while ((same < common) && (bytes[base + same] == prev[base + same]))
+    {
+        same++;
+    }
+    if ((w->listing_count > 0) && (out_size == w->out_size))
+    {
+        int changed_end = out_size;
+        while ((changed_end > same) && (bytes[base + changed_end - 1] == prev[base + changed_end - 1]))
+        {
+            changed_end--;
+        }
+        watch_swap(w, as);
+        stats->listing_reused = w->listing_count;
+        if (same < changed_end)
+        {
+            watch_relist(w, same, changed_end, stats);
+        }
+        return;
+    }
+    int kept = w->listing_count;
+    while ((kept > 0) && (w->listing_offsets[kept - 1] + opcodes[bytes[base + w->listing_offsets[kept - 1]]].length > same))
+    {
+        kept--;
+    }
+    stats->listing_reused = kept;
+
+    if (w->listing.data == 0)
+    {
+        output_init(&w->listing, 0, OUTPUT_BUFFER_SIZE);
+    }
+    if (kept < w->listing_count)
+    {
+        w->listing.used = w->listing_positions[kept];
+    }
+    else if (w->listing_count == 0)
+    {
+        w->listing.used = 0;
+        output_text(&w->listing, "Address  Hexdump   Dissassembly\n");
+        output_text(&w->listing, "-------------------------------\n");
+    }
+    w->listing_count = kept;
+
+    int pos = kept ? w->listing_offsets[kept - 1] + opcodes[bytes[base + w->listing_offsets[kept - 1]]].length : 0;
+    while (pos < out_size)
+    {
+        if (w->listing_count == w->listing_capacity)
+        {
+            w->listing_capacity = w->listing_capacity ? w->listing_capacity * 2 : 1024;
+            w->listing_offsets = (int *)realloc(w->listing_offsets, w->listing_capacity * sizeof(int));
+            w->listing_positions = (int *)realloc(w->listing_positions, w->listing_capacity * sizeof(int));
+        }
+        w->listing_offsets[w->listing_count] = pos;
+        w->listing_positions[w->listing_count] = w->listing.used;
+        w->listing_count++;
+        pos += disasm_single(bytes + base, pos, out_size, base, &w->listing);
+    }
+
+    watch_swap(w, as);
+    w->out_size = out_size;
+}
+
+// an edit that only replaced instructions and data by the same number of bytes, and kept
+// every label at its address, changes no symbol, so the symbols of the previous assembly
+// still hold. the edited lines are encoded into the spare buffer and copied over the
+// previous output, without walking the rest of the file. returns false when it needs a
+// full assembly
+bool watch_patch(watch_state *w, assembler *as, watch_stats *stats)
+{
+    int start = w->patch_address - w->base_address;
+    if (!w->patchable || (start < 0) || (start + w->patch_size > w->out_size))
+    {
+        return false;
+    }
+
+    unsigned char *scratch = as->out_data; // cleared by the next full assembly
+    int reports = as->report_count;
+    int fixups = as->fixup_count;
+    int pass = as->pass;
+    as->pass = 1; // an undefined symbol adds a fixup
+    as->quiet = true;
+    int offset = w->patch_address;
+    int last = w->patch_first + w->patch_count;
+    int parsed = w->patch_first;
+    const char *label = w->patch_labels.data;
+    const char *labels_end = w->patch_labels.data + w->patch_labels.used;
+    bool ok = true;
+    while (ok && (parsed < last))
+    {
+        watch_line *l = &w->lines[parsed++];
+        l->address = offset;
+        watch_parse(as, l, offset, stats);
+        if (l->parsed.label.length > 0)
+        {
+            // the next label the replaced lines had, with the same name and address
+            int old[2];
+            ok = (label < labels_end);
+            if (ok)
             {
-                length++;
+                memcpy(old, label, sizeof(old));
+                ok = (old[0] == offset) && (old[1] == l->parsed.label.length) &&
+                    (memcmp(label + sizeof(old), l->parsed.label.text, old[1]) == 0);
+                label += sizeof(old) + old[1];
+            }
+        }
+        if (!ok || (l->kind == line_define) || (l->kind == line_origin))
+        {
+            ok = false;
+        }
+        else if (l->kind == line_dcb)
+        {
+            l->size = translate_dcb(as, l->parsed.args, offset, scratch);
+            stats->encoded++;
+        }
+        else if (l->kind == line_instruction)
+        {
+            int value;
+            text_view missing;
+            ok = image_fits(as, offset, 5) && eval_expr(as, l->expr_text, l->ops, l->op_count, offset, &value, &missing);
+            if (ok)
+            {
+                l->size = translate_instruction(l->parsed.op, l->mode, offset, value, 0, scratch + offset, 0);
+                l->operand = value;
+                stats->encoded++;
+            }
+        }
+        offset += l->size;
+    }
+    as->pass = pass;
+    as->quiet = false;
+    watch_written(w->spare_written, w->patch_address, offset);
+    ok = ok && (label == labels_end); // none was removed
+
+    if (!ok || (as->report_count != reports) || (as->fixup_count != fixups) || (offset - w->patch_address != w->patch_size))
+    {
+        // the full assembly parses them again and reports the errors
+        for (int i = w->patch_first; i < parsed; i++)
+        {
+            free(w->lines[i].ops);
+            w->lines[i].ops = 0;
+        }
+        return false;
+    }
+
+    for (int i = w->patch_first; i < last; i++)
+    {
+        w->lines[i].dirty = false;
+    }
+    stats->listing_reused = w->listing_count;
+    if (w->patch_size > 0)
+    {
+        memcpy(w->prev_data + w->patch_address, scratch + w->patch_address, w->patch_size);
+        watch_relist(w, start, start + w->patch_size, stats);
+    }
+    return true;
+}
+
+void watch_build(watch_state *w, assembler *as)
+{
+    double t0 = get_seconds();
+    if (!watch_load(w))
+    {
+        report(as, "Error opening input file: %s\n", w->name);
+        return;
+    }
+    watch_stats stats = {};
+    if (!watch_patch(w, as, &stats))
+    {
+        watch_assemble(w, as, &stats);
+    }
+    double t1 = get_seconds();
+
+    char outname[100];
+    listing_name(w->name, outname);
+    FILE *f_out;
+    fopen_s(&f_out, outname, "wb");
+    if (f_out)
+    {
+        fwrite(w->listing.data, 1, w->listing.used, f_out);
+        fclose(f_out);
+    }
+    else
+    {
+        report(as, "Error opening output file: %s\n", outname);
+    }
+
+    report(as, "Assembled %s: %d lines, %d parsed, %d encoded, %d listing lines reused, %.3f ms\n",
+        w->name, w->line_count, stats.parsed, stats.encoded, stats.listing_reused, (t1 - t0) * 1000.0);
+}
+
+// runs until the process is interrupted
+void watch_jobs(asm_job *jobs, int job_count)
+{
+    watch_state *states = (watch_state *)calloc(job_count, sizeof(watch_state));
+    for (int i = 0; i < job_count; i++)
+    {
+        watch_state *w = &states[i];
+        w->name = jobs[i].name;
+        w->base_address = jobs[i].base_address;
+        assembler_init(&w->as, 0);
+        w->prev_data = (unsigned char *)calloc(IMAGE_SIZE, 1);
+        file_stamp(w->name, &w->stamp, &w->file_size);
+        watch_build(w, &w->as);
+    }
+    fflush(stdout);
+
+    for (;;)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        for (int i = 0; i < job_count; i++)
+        {
+            watch_state *w = &states[i];
+            long long stamp, size;
+            if (file_stamp(w->name, &stamp, &size) && ((stamp != w->stamp) || (size != w->file_size)))
+            {
+                w->stamp = stamp;
+                w->file_size = size;
+                watch_build(w, &w->as);
+                fflush(stdout);
             }
-            c++;
         }
     }
-    return offset - base_address;
 }
 
-int asm_program(const char *program, unsigned char *bytes, int size, int base_address)
+// --server <path>: persistent assembler listening on a unix domain socket, so callers don't pay
+// process startup and table initialization per file. --connect <path> sends the files that
+// follow to such a server instead of processing them locally.
+//
+// the server runs the same job as a local run and sends back what it would print and the
+// files it would write, which the client then writes itself.
+//
+// protocol, all fields are 32-bit little endian:
+//   request:  magic, flags, base address, bank size, run limit low, run limit high, stats format,
+//             binary format, listing threads, name size, source size, name, source
+//   response: magic, log size, files size, log, files
+// each file is name size, data size, name, data
+
+#define SERVER_MAGIC 0x52353642 // "B65R"
+#define SERVER_MAX_REQUEST (256 * 1024 * 1024)
+#define SERVER_MAX_NAME 4096
+
+enum server_flags
 {
-    int byte_size = translate_program(program, bytes, size, base_address);
-#if 0
-    printf("\nDEFINES\n=======\n");
-    print_symbols(defines);
-    printf("\nLABELS\n=======\n");
-    print_symbols(labels);
-#endif
-    return byte_size;
+    server_disasm = 1,
+    server_trace = 2,
+    server_optimize = 4,
+    server_cycles = 8,
+    server_symbols = 16,
+};
+
+enum server_request
+{
+    request_magic,
+    request_flags,
+    request_base,
+    request_bank_size,
+    request_run_low,
+    request_run_high,
+    request_stats,
+    request_format,
+    request_threads,
+    request_name_size,
+    request_source_size,
+    request_fields
+};
+
+#ifndef _WIN32
+
+bool read_full(int fd, void *data, size_t size)
+{
+    unsigned char *p = (unsigned char *)data;
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
 }
 
-void asm_test()
+bool write_full(int fd, const void *data, size_t size)
 {
-#if 1
-    const char *program =
-        "; static noise\n"
-        "\n"
-        "define symbol 123\n"
-        "start: ldy #$ff\n\r"
-        "       ldx\t#$0\n"
-        "loop:  lda $fe\n"
-        "   \t    sta $200  ,  x\n"
-        "       and #$7\n"
-        "define another $123\n"
-        "       sta $300, x\r"
-        "       and #$3\n"
-        "       sta $400 ,x\n"
-        "      and   #$1\n"
-        "       sta $500,x\n"
-        "       inx\n"
-        "       dey\n"
-        "       bne loop\n"
-        "       rts\n"
-        "*=512\n"
-        "offset512:"
-        "*=$400\n"
-        "offsetx400:"
-        //"label: dcb 12,34,56"
-        ;
+    const unsigned char *p = (const unsigned char *)data;
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// everything a connection needs, kept between connections so buffers are reused
+struct server_worker
+{
+    assembler as;
+    output_buffer log;
+    output_buffer files;
+    unsigned char *request;
+    int request_capacity;
+    server_worker *next;
+};
+
+server_worker *idle_workers = 0;
+std::mutex idle_workers_mutex;
+
+server_worker *get_worker()
+{
+    {
+        std::lock_guard<std::mutex> lock(idle_workers_mutex);
+        if (idle_workers)
+        {
+            server_worker *worker = idle_workers;
+            idle_workers = worker->next;
+            return worker;
+        }
+    }
+    server_worker *worker = (server_worker *)calloc(1, sizeof(server_worker));
+    output_init(&worker->log, 0, 4096);
+    output_init(&worker->files, 0, OUTPUT_BUFFER_SIZE);
+    assembler_init(&worker->as, &worker->log);
+    return worker;
+}
+
+void put_worker(server_worker *worker)
+{
+    std::lock_guard<std::mutex> lock(idle_workers_mutex);
+    worker->next = idle_workers;
+    idle_workers = worker;
+}
+
+void serve_connection(int fd)
+{
+    server_worker *worker = get_worker();
+    assembler *as = &worker->as;
+
+    for (;;)
+    {
+        unsigned int header[request_fields];
+        if (!read_full(fd, header, sizeof(header)) || (header[request_magic] != SERVER_MAGIC) ||
+            (header[request_name_size] > SERVER_MAX_NAME) || (header[request_source_size] > SERVER_MAX_REQUEST))
+        {
+            break;
+        }
+        int name_size = (int)header[request_name_size];
+        int size = (int)header[request_source_size];
+
+        // the name is zero terminated in front of the source
+        if (name_size + 1 + size + 1 > worker->request_capacity)
+        {
+            worker->request_capacity = name_size + 1 + size + 1;
+            worker->request = (unsigned char *)realloc(worker->request, worker->request_capacity);
+        }
+        if (!read_full(fd, worker->request, name_size) || !read_full(fd, worker->request + name_size + 1, size))
+        {
+            break;
+        }
+        worker->request[name_size] = 0;
+
+        asm_job job = {};
+        job.name = (const char *)worker->request;
+        job.data = worker->request + name_size + 1;
+        job.size = size;
+        job.base_address = (int)header[request_base];
+        job.disasm = (header[request_flags] & server_disasm) != 0;
+        job.trace = (header[request_flags] & server_trace) != 0;
+        job.optimize = (header[request_flags] & server_optimize) != 0;
+        job.cycles = (header[request_flags] & server_cycles) != 0;
+        job.symbols = (header[request_flags] & server_symbols) != 0;
+        job.bank_size = (int)header[request_bank_size];
+        job.run_limit = (long long)header[request_run_low] | ((long long)header[request_run_high] << 32);
+        job.stats = (stats_format)header[request_stats];
+        job.format = (binary_format)header[request_format];
+        job.files = &worker->files;
+        disasm_threads = (header[request_threads] > 0) ? (int)header[request_threads] : 1;
+
+        worker->log.used = 0;
+        worker->files.used = 0;
+
+        // the same limits main puts on the options, checked before anything is written at them
+        if ((job.base_address < 0) || (job.base_address > 0xFFFF))
+        {
+            report(as, "Invalid base address: $%x\n", (unsigned int)job.base_address);
+        }
+        else if ((job.bank_size < 0) || (job.bank_size > 0x10000) || (job.run_limit < 0) ||
+            (header[request_stats] > stats_json) || (header[request_format] > binary_srec))
+        {
+            report(as, "Invalid options for file: %s\n", job.name);
+        }
+        else
+        {
+            run_job(as, &job);
+        }
+
+        unsigned int response[3] = { SERVER_MAGIC, (unsigned int)worker->log.used, (unsigned int)worker->files.used };
+        if (!write_full(fd, response, sizeof(response)) ||
+            !write_full(fd, worker->log.data, worker->log.used) ||
+            !write_full(fd, worker->files.data, worker->files.used))
+        {
+            break;
+        }
+    }
+
+    close(fd);
+    put_worker(worker);
+}
+
+int run_server(const char *path)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if ((fd < 0) || (strlen(path) >= sizeof(addr.sun_path)))
+    {
+        printf("Error creating socket: %s\n", path);
+        return 1;
+    }
+    strcpy_s(addr.sun_path, sizeof(addr.sun_path), path);
+    unlink(path);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(fd, 64) != 0))
+    {
+        printf("Error listening on socket: %s\n", path);
+        close(fd);
+        return 1;
+    }
+
+    printf("Listening on: %s\n", path);
+    fflush(stdout);
+    for (;;)
+    {
+        int client = accept(fd, 0, 0);
+        if (client < 0)
+        {
+            continue;
+        }
+        std::thread(serve_connection, client).detach();
+    }
+}
+
+int connect_server(const char *path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if ((fd < 0) || (strlen(path) >= sizeof(addr.sun_path)))
+    {
+        return -1;
+    }
+    strcpy_s(addr.sun_path, sizeof(addr.sun_path), path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// same output as run_job, but the work is done by the server
+bool run_remote_job(int fd, asm_job *job)
+{
+    input_file in;
+    if (!open_input(job->name, &in))
+    {
+        printf("Error opening input file: %s\n", job->name);
+        return true;
+    }
+
+    unsigned int flags = (job->disasm ? server_disasm : 0) | (job->trace ? server_trace : 0) |
+        (job->optimize ? server_optimize : 0) | (job->cycles ? server_cycles : 0) | (job->symbols ? server_symbols : 0);
+    unsigned int name_size = (unsigned int)strlen(job->name);
+    unsigned int request[request_fields] = {};
+    request[request_magic] = SERVER_MAGIC;
+    request[request_flags] = flags;
+    request[request_base] = (unsigned int)job->base_address;
+    request[request_bank_size] = (unsigned int)job->bank_size;
+    request[request_run_low] = (unsigned int)job->run_limit;
+    request[request_run_high] = (unsigned int)(job->run_limit >> 32);
+    request[request_stats] = (unsigned int)job->stats;
+    request[request_format] = (unsigned int)job->format;
+    request[request_threads] = (unsigned int)disasm_threads;
+    request[request_name_size] = name_size;
+    request[request_source_size] = (unsigned int)in.size;
+    unsigned int response[3];
+    bool ok = (name_size <= SERVER_MAX_NAME) && write_full(fd, request, sizeof(request)) &&
+        write_full(fd, job->name, name_size) && write_full(fd, in.data, in.size) &&
+        read_full(fd, response, sizeof(response)) && (response[0] == SERVER_MAGIC);
+    close_input(&in);
+    if (!ok)
+    {
+        printf("Error talking to server\n");
+        return false;
+    }
+
+    size_t total = (size_t)response[1] + response[2];
+    char *data = (char *)malloc(total + 1);
+    if (!read_full(fd, data, total))
+    {
+        printf("Error talking to server\n");
+        free(data);
+        return false;
+    }
+    fwrite(data, 1, response[1], stdout);
+
+    // the files the server would have written, in the same order
+    const char *p = data + response[1];
+    const char *end = data + total;
+    while (end - p >= 8)
+    {
+        unsigned int sizes[2];
+        memcpy(sizes, p, sizeof(sizes));
+        p += sizeof(sizes);
+        if ((sizes[0] >= 100) || (sizes[0] > (size_t)(end - p)) || (sizes[1] > (size_t)(end - p) - sizes[0]))
+        {
+            printf("Error talking to server\n");
+            free(data);
+            return false;
+        }
+        char outname[100];
+        memcpy(outname, p, sizes[0]);
+        outname[sizes[0]] = 0;
+        p += sizes[0];
+
+        FILE *f_out;
+        fopen_s(&f_out, outname, "wb");
+        if (f_out)
+        {
+            fwrite(p, 1, sizes[1], f_out);
+            fclose(f_out);
+        }
+        else
+        {
+            printf("Error opening output file: %s\n", outname);
+        }
+        p += sizes[1];
+    }
+
+    free(data);
+    return true;
+}
+
+int run_client(const char *path, asm_job *jobs, int job_count)
+{
+    int fd = connect_server(path);
+    if (fd < 0)
+    {
+        printf("Error connecting to server: %s\n", path);
+        return 1;
+    }
+    for (int i = 0; i < job_count; i++)
+    {
+        if (!run_remote_job(fd, &jobs[i]))
+        {
+            close(fd);
+            return 1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
 #else
-    const char *program =
-        "XXX #$FFFF\n"
-        "XXX #9999\n"
-        "XXX #<label\n"
-        "XXX #>label\n"
-        "XXX #symbol\n"
-        "XXX $FFFF\n"
-        "XXX $0,x \n"
-        "XXX $FFFF ,x\n"
-        "XXX $FFFF,y\n"
-        "XXX ($0 ),y\n"
-        "XXX ($0,x)\n"
-        "XXX (label ) , y\n"
-        "XXX (label , x)\n"
-        "XXX 9999\n"
-        "XXX label\n"
-        "XXX label,x\n"
-        "XXX label,y\n"
-        "XXX a\n";
 
-#endif
-    unsigned char *bytes = (unsigned char *)malloc(0x10000);
-    int size = asm_program(program, bytes, sizeof(program) - 1, 0x600);
-    disasm_program(bytes, size, 0x600, stdout);
+int run_server(const char *path)
+{
+    printf("Server mode is not supported on this platform\n");
+    return 1;
+}
+
+int run_client(const char *path, asm_job *jobs, int job_count)
+{
+    printf("Client mode is not supported on this platform\n");
+    return 1;
 }
 
+#endif
+
 int main(int argc, char *argv[])
 {
     bool disasm = false;
+    bool trace = false;
+    bool watch = false;
+    stats_format stats = stats_off;
+    long long run_limit = 0;
+    bool optimize = false;
+    bool cycles = false;
+    binary_format format = binary_none;
+    int bank_size = 0;
+    bool symbols = false;
+    const char *server_path = 0;
     int base_address = 0x600;
+    int job_threads = 1;
 
-    init();
-
-    int out_buffer_size = 0x10000;
-    unsigned char *out_data = (unsigned char *)malloc(out_buffer_size);
+    asm_job *jobs = (asm_job *)calloc(argc, sizeof(asm_job));
+    int job_count = 0;
 
     for (int i = 1; i < argc; i++)
     {
-        if (argv[i][0] == '-' && argv[i][1] == 'd')
+        if (strcmp(argv[i], "--watch") == 0)
+        {
+            watch = true;
+        }
+        else if ((strcmp(argv[i], "--server") == 0) && (i + 1 < argc))
+        {
+            return run_server(argv[++i]);
+        }
+        else if (strncmp(argv[i], "--stats", 7) == 0)
+        {
+            stats = (strcmp(argv[i], "--stats=json") == 0) ? stats_json : stats_text;
+        }
+        else if (strcmp(argv[i], "--bench") == 0)
+        {
+            return bench_suite();
+        }
+        else if (strcmp(argv[i], "--check") == 0)
+        {
+            return check_suite();
+        }
+        else if ((strcmp(argv[i], "--connect") == 0) && (i + 1 < argc))
+        {
+            server_path = argv[++i];
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'd')
         {
             disasm = true;
         }
-        else if (argv[i][0] == '-' && argv[i][1] == 'b')
+        else if (argv[i][0] == '-' && argv[i][1] == 'r')
         {
-            base_address = parse_value(&argv[i][2]);
+            disasm = true;
+            trace = true;
         }
-        else
+        else if (argv[i][0] == '-' && argv[i][1] == 'j')
         {
-            FILE *f_in;
-            fopen_s(&f_in, argv[i], "rb");
-            
-            if (f_in)
+            // "-j 4" takes the next argument only if it is a number, "-j" alone means all cores
+            const char *value = &argv[i][2];
+            if (!*value && (i + 1 < argc) && argv[i + 1][0] && !argv[i + 1][strspn(argv[i + 1], "0123456789")])
             {
-                printf("Processing file: %s\n", argv[i]);
-                free_symbols(&labels);
-                free_symbols(&defines);
-                assert(labels == 0);
-                assert(defines == 0);
-
-                fseek(f_in, 0, SEEK_END);
-                int input_size = ftell(f_in);
-                unsigned char *input_data = (unsigned char *)malloc(input_size);
-
-                fseek(f_in, 0, SEEK_SET);
-                fread((void *)input_data, input_size, 1, f_in);
-                fclose(f_in);
-
-                if (!disasm)
-                {
-                    memset(out_data, 0, out_buffer_size);
-                    int out_size = asm_program((const char *)input_data, out_data, input_size, base_address);
-
-                    FILE *f_out;
-                    char outname[100] = "../disasm/";
-                    strcat_s(outname, argv[i]);
-                    int len = strnlen_s(outname, sizeof(outname));
-                    outname[len - 3] = 0;
-                    strcat_s(outname, "disasm");
-
-                    printf("Writing to file: %s\n", outname);
-                    fopen_s(&f_out, outname, "wb");
-                    if (f_out)
-                    {
-                        disasm_program(out_data, out_size, base_address, f_out);
-                        fclose(f_out);
-                    }
-                    else
-                    {
-                        printf("Error opening output file: %s\n", outname);
-                    }
-                }
-                else
-                {
-                    disasm_program(input_data, input_size, base_address, stdout);
-                }
-
-                free(input_data);
+                value = argv[++i];
+            }
+            job_threads = *value ? parse_value(value, (int)strlen(value)) : (int)std::thread::hardware_concurrency();
+            if (job_threads < 1)
+            {
+                job_threads = 1;
+            }
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 't')
+        {
+            disasm_threads = argv[i][2] ? parse_value(&argv[i][2], (int)strlen(&argv[i][2])) : (int)std::thread::hardware_concurrency();
+            if (disasm_threads < 1)
+            {
+                disasm_threads = 1;
+            }
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'x')
+        {
+            run_limit = argv[i][2] ? parse_value(&argv[i][2], (int)strlen(&argv[i][2])) : 100000000;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'c')
+        {
+            cycles = true;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'f')
+        {
+            format = parse_binary_format(&argv[i][2]);
+            if (format == binary_none)
+            {
+                printf("Unknown output format: %s (bin, prg, hex or srec)\n", &argv[i][2]);
+            }
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'O')
+        {
+            optimize = true;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 's')
+        {
+            symbols = true;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'k')
+        {
+            bank_size = argv[i][2] ? parse_value(&argv[i][2], (int)strlen(&argv[i][2])) : 0x4000;
+            if ((bank_size < 0) || (bank_size > 0x10000))
+            {
+                printf("Invalid bank size: %s\n", &argv[i][2]);
+                bank_size = 0;
+            }
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'p')
+        {
+            disasm_bench();
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'b')
+        {
+            int value = parse_value(&argv[i][2], (int)strlen(&argv[i][2]));
+            if ((value < 0) || (value > 0xFFFF))
+            {
+                printf("Invalid base address: %s\n", &argv[i][2]);
             }
             else
             {
-                printf("Error opening input file: %s\n", argv[i]);
+                base_address = value;
             }
         }
+        else
+        {
+            asm_job *job = &jobs[job_count++];
+            job->name = argv[i];
+            job->base_address = base_address;
+            job->disasm = disasm;
+            job->trace = trace;
+            job->stats = stats;
+            job->run_limit = run_limit;
+            job->optimize = optimize;
+            job->cycles = cycles;
+            job->format = format;
+            job->bank_size = bank_size;
+            job->symbols = symbols;
+        }
     }
 
+    if (server_path)
+    {
+        // no pause, the client is meant to be called from scripts
+        int result = run_client(server_path, jobs, job_count);
+        free(jobs);
+        return result;
+    }
+    else if (watch)
+    {
+        watch_jobs(jobs, job_count);
+    }
+    else if ((job_threads > 1) && (job_count > 1))
+    {
+        for (int i = 0; i < job_count; i++)
+        {
+            output_init(&jobs[i].log, 0, 4096);
+        }
+        run_jobs_parallel(jobs, job_count, job_threads);
+    }
+    else
+    {
+        assembler as;
+        output_buffer log;
+        output_init(&log, stdout, OUTPUT_BUFFER_SIZE);
+        assembler_init(&as, &log);
+        for (int i = 0; i < job_count; i++)
+        {
+            run_job(&as, &jobs[i]);
+            output_flush(&log);
+        }
+        assembler_free(&as);
+        output_free(&log);
+    }
+
+    free(jobs);
+
     system("pause");
     return 0;
-}
\ No newline at end of file
+}